@@ -0,0 +1,420 @@
+#pragma once
+
+#include <vector>
+#include <span>
+#include <algorithm>
+#include <cmath>
+#include <limits>
+#include <cstdint>
+
+#include "model.hpp"
+#include "sparse.hpp"
+#include "thread_pool.hpp"
+#include "cholesky.hpp"
+
+// Smoothed aggregation algebraic multigrid for the symmetric M-matrices of the implicit steps. Every level groups
+// the vertices into aggregates of a root and its unaggregated neighbors, the piecewise constant prolongation over
+// the aggregates is smoothed with one damped Jacobi step, and the coarse operator is the Galerkin product R A P with
+// R = P^T. Smoothing is damped Jacobi, which is fully parallel, and the coarsest level is solved exactly with an
+// LDL^T factorization. Iteration counts of a V-cycle stay flat as the mesh is refined, so an implicit step costs a
+// fixed number of passes over the matrix.
+
+// Plain CSR with the diagonal among the entries, for the prolongations and the intermediate products.
+template<typename T>
+struct basic_csr_matrix {
+    uint32_t columnCount = 0;
+    std::vector<uint32_t> offsets{0};
+    std::vector<uint32_t> columns;
+    std::vector<T> values;
+
+    size_t size() const { return offsets.size() - 1; }
+};
+
+template<typename T>
+basic_csr_matrix<T> to_csr_matrix(const basic_csr_view<T> &A) {
+    basic_csr_matrix<T> C;
+    C.columnCount = A.size();
+    C.offsets.resize(A.size() + 1);
+    C.columns.reserve(A.columns.size() + A.size());
+    C.values.reserve(A.columns.size() + A.size());
+
+    for (uint32_t i = 0; i < A.size(); i++) {
+        C.columns.push_back(i);
+        C.values.push_back(A.diagonal[i]);
+        for (auto k = A.offsets[i]; k < A.offsets[i + 1]; k++) {
+            C.columns.push_back(A.columns[k]);
+            C.values.push_back(A.values[k]);
+        }
+        C.offsets[i + 1] = C.columns.size();
+    }
+
+    return C;
+}
+
+template<typename T>
+basic_csr_matrix<T> transpose(const basic_csr_matrix<T> &A) {
+    basic_csr_matrix<T> C;
+    C.columnCount = A.size();
+    C.offsets.assign(A.columnCount + 1, 0);
+    C.columns.resize(A.columns.size());
+    C.values.resize(A.values.size());
+
+    for (const auto &j : A.columns) C.offsets[j + 1]++;
+    for (uint32_t j = 0; j < A.columnCount; j++) C.offsets[j + 1] += C.offsets[j];
+
+    auto positions = C.offsets;
+    for (uint32_t i = 0; i < A.size(); i++) {
+        for (auto k = A.offsets[i]; k < A.offsets[i + 1]; k++) {
+            const auto p = positions[A.columns[k]]++;
+            C.columns[p] = i;
+            C.values[p] = A.values[k];
+        }
+    }
+
+    return C;
+}
+
+// A B, row by row with a dense accumulator per worker. A counting pass sizes the rows, so the filling pass writes
+// every row in place and the result does not depend on the number of workers.
+template<typename T>
+basic_csr_matrix<T> multiply(const basic_csr_matrix<T> &A, const basic_csr_matrix<T> &B, thread_pool &pool) {
+    basic_csr_matrix<T> C;
+    C.columnCount = B.columnCount;
+    C.offsets.assign(A.size() + 1, 0);
+
+    pool.parallel_for(A.size(), [&](size_t start, size_t end) {
+        thread_local std::vector<uint32_t> marker;
+        marker.assign(B.columnCount, invalid_index);
+
+        for (auto i = start; i < end; i++) {
+            uint32_t count = 0;
+            for (auto k = A.offsets[i]; k < A.offsets[i + 1]; k++) {
+                const auto j = A.columns[k];
+                for (auto l = B.offsets[j]; l < B.offsets[j + 1]; l++) {
+                    if (marker[B.columns[l]] != i) {
+                        marker[B.columns[l]] = i;
+                        count++;
+                    }
+                }
+            }
+            C.offsets[i + 1] = count;
+        }
+    });
+
+    for (size_t i = 0; i < A.size(); i++) C.offsets[i + 1] += C.offsets[i];
+    C.columns.resize(C.offsets.back());
+    C.values.resize(C.offsets.back());
+
+    pool.parallel_for(A.size(), [&](size_t start, size_t end) {
+        thread_local std::vector<uint32_t> slot;
+        slot.assign(B.columnCount, invalid_index);
+
+        for (auto i = start; i < end; i++) {
+            const auto row = C.offsets[i];
+            auto next = row;
+            for (auto k = A.offsets[i]; k < A.offsets[i + 1]; k++) {
+                const auto j = A.columns[k];
+                const auto a = A.values[k];
+                for (auto l = B.offsets[j]; l < B.offsets[j + 1]; l++) {
+                    const auto c = B.columns[l];
+                    if (slot[c] == invalid_index || slot[c] < row) {
+                        slot[c] = next;
+                        C.columns[next] = c;
+                        C.values[next] = a * B.values[l];
+                        next++;
+                    } else {
+                        C.values[slot[c]] += a * B.values[l];
+                    }
+                }
+            }
+        }
+    });
+
+    return C;
+}
+
+struct amg_options {
+    // Levels stop coarsening at this many rows, the last one is factored.
+    uint32_t coarseSize = 500;
+    uint32_t maxLevels = 16;
+    // Strength of connection threshold of the aggregation, relative to the strongest connection of a row.
+    double strength = 0.25;
+    // Jacobi sweeps before and after the coarse correction.
+    uint32_t smoothingSteps = 1;
+};
+
+template<typename T>
+struct basic_amg_level {
+    // The level's operator, diagonal apart.
+    std::vector<uint32_t> offsets;
+    std::vector<uint32_t> columns;
+    std::vector<T> values;
+    std::vector<T> diagonal;
+    // Damped Jacobi weight, 4 / (3 rho(D^-1 A)) with rho bounded by Gershgorin.
+    T omega = 0;
+    // Prolongation from the next coarser level and its transpose.
+    basic_csr_matrix<T> prolongation;
+    basic_csr_matrix<T> restriction;
+
+    std::vector<T> x, b, r;
+
+    size_t size() const { return diagonal.size(); }
+
+    basic_csr_view<T> view() const { return {offsets, columns, values, diagonal}; }
+};
+
+template<typename T>
+class basic_amg {
+public:
+    void build(const basic_csr_view<T> &A, thread_pool &pool, const amg_options &options = {}) {
+        this->options = options;
+        levels.clear();
+
+        auto &finest = levels.emplace_back();
+        finest.offsets.assign(A.offsets.begin(), A.offsets.end());
+        finest.columns.assign(A.columns.begin(), A.columns.end());
+        finest.values.assign(A.values.begin(), A.values.end());
+        finest.diagonal.assign(A.diagonal.begin(), A.diagonal.end());
+
+        while (true) {
+            auto &level = levels.back();
+            level.omega = jacobi_weight(level.view());
+            level.x.resize(level.size());
+            level.b.resize(level.size());
+            level.r.resize(level.size());
+
+            if (level.size() <= options.coarseSize || levels.size() == options.maxLevels) break;
+
+            const auto full = to_csr_matrix(level.view());
+            level.prolongation = smoothed_prolongation(full, level, T(options.strength), pool);
+            if (level.prolongation.columnCount >= level.size()) break;
+            level.restriction = transpose(level.prolongation);
+
+            const auto coarse = multiply(level.restriction, multiply(full, level.prolongation, pool), pool);
+
+            auto &next = levels.emplace_back();
+            split_diagonal(coarse, next);
+        }
+
+        // Should a pivot vanish the coarsest level is only smoothed, which keeps the cycle a convergent, if slower,
+        // preconditioner.
+        coarsest.factor(levels.back().view());
+    }
+
+    size_t level_count() const { return levels.size(); }
+
+    // Rows of a level.
+    size_t level_size(size_t l) const { return levels[l].size(); }
+
+    // Nonzeros over all levels relative to the finest level.
+    double operator_complexity() const {
+        double total = 0;
+        for (const auto &level : levels) total += level.columns.size() + level.size();
+        return total / (levels[0].columns.size() + levels[0].size());
+    }
+
+    // One V-cycle on A x = b from the x passed in. With the same number of pre- and post-smoothing sweeps the cycle is
+    // a symmetric operator, so it can precondition CG.
+    void vcycle(const T *b, T *x, thread_pool &pool) {
+        auto &finest = levels[0];
+        const auto n = finest.size();
+        pool.parallel_for(n, [&](size_t start, size_t end) {
+            std::copy(b + start, b + end, finest.b.data() + start);
+            std::copy(x + start, x + end, finest.x.data() + start);
+        });
+
+        cycle(0, pool);
+
+        pool.parallel_for(n, [&](size_t start, size_t end) {
+            std::copy(finest.x.data() + start, finest.x.data() + end, x + start);
+        });
+    }
+
+private:
+    amg_options options;
+    std::vector<basic_amg_level<T>> levels;
+    basic_ldlt<T> coarsest;
+
+    static T jacobi_weight(const basic_csr_view<T> &A) {
+        T rho = 0;
+        for (size_t i = 0; i < A.size(); i++) {
+            T sum = std::abs(A.diagonal[i]);
+            for (auto k = A.offsets[i]; k < A.offsets[i + 1]; k++) {
+                sum += std::abs(A.values[k]);
+            }
+            rho = std::max(rho, sum / A.diagonal[i]);
+        }
+        return T(4) / (3 * rho);
+    }
+
+    // Greedy aggregation over the strong connections, those with -a_ij >= theta max_k(-a_ik). A vertex whose strong
+    // neighbors are all unaggregated becomes the root of an aggregate with them, the vertices left over join the
+    // aggregate of a strong neighbor, and whatever still remains forms aggregates of its own.
+    static std::vector<uint32_t> aggregate(const basic_csr_view<T> &A, T theta, uint32_t &count) {
+        const auto n = A.size();
+
+        std::vector<T> thresholds(n);
+        for (uint32_t i = 0; i < n; i++) {
+            T strongest = 0;
+            for (auto k = A.offsets[i]; k < A.offsets[i + 1]; k++) {
+                strongest = std::max(strongest, -A.values[k]);
+            }
+            thresholds[i] = strongest > 0 ? theta * strongest : std::numeric_limits<T>::infinity();
+        }
+        auto strong = [&](uint32_t i, uint32_t k) { return -A.values[k] >= thresholds[i]; };
+
+        std::vector<uint32_t> aggregates(n, invalid_index);
+        count = 0;
+
+        for (uint32_t i = 0; i < n; i++) {
+            if (aggregates[i] != invalid_index) continue;
+            bool free = true;
+            for (auto k = A.offsets[i]; k < A.offsets[i + 1] && free; k++) {
+                free = !strong(i, k) || aggregates[A.columns[k]] == invalid_index;
+            }
+            if (!free) continue;
+
+            aggregates[i] = count;
+            for (auto k = A.offsets[i]; k < A.offsets[i + 1]; k++) {
+                if (strong(i, k)) aggregates[A.columns[k]] = count;
+            }
+            count++;
+        }
+
+        // Joining uses the first pass's aggregates only, so a joined vertex never pulls in another one.
+        auto joined = aggregates;
+        for (uint32_t i = 0; i < n; i++) {
+            if (aggregates[i] != invalid_index) continue;
+            for (auto k = A.offsets[i]; k < A.offsets[i + 1]; k++) {
+                if (strong(i, k) && aggregates[A.columns[k]] != invalid_index) {
+                    joined[i] = aggregates[A.columns[k]];
+                    break;
+                }
+            }
+        }
+
+        for (uint32_t i = 0; i < n; i++) {
+            if (joined[i] != invalid_index) continue;
+            joined[i] = count;
+            for (auto k = A.offsets[i]; k < A.offsets[i + 1]; k++) {
+                if (strong(i, k) && joined[A.columns[k]] == invalid_index) joined[A.columns[k]] = count;
+            }
+            count++;
+        }
+
+        return joined;
+    }
+
+    // P = (I - omega D^-1 A) P0 with P0 the piecewise constant prolongation over the aggregates.
+    static basic_csr_matrix<T> smoothed_prolongation(const basic_csr_matrix<T> &A, const basic_amg_level<T> &level,
+                                                     T theta, thread_pool &pool) {
+        uint32_t count;
+        const auto aggregates = aggregate(level.view(), theta, count);
+
+        basic_csr_matrix<T> P0;
+        P0.columnCount = count;
+        P0.offsets.resize(level.size() + 1);
+        P0.columns = aggregates;
+        P0.values.assign(level.size(), 1);
+        for (uint32_t i = 0; i <= level.size(); i++) P0.offsets[i] = i;
+
+        auto P = multiply(A, P0, pool);
+        pool.parallel_for(P.size(), [&](size_t start, size_t end) {
+            for (auto i = start; i < end; i++) {
+                const auto scale = -level.omega / level.diagonal[i];
+                for (auto k = P.offsets[i]; k < P.offsets[i + 1]; k++) {
+                    P.values[k] *= scale;
+                    if (P.columns[k] == aggregates[i]) P.values[k] += 1;
+                }
+            }
+        });
+
+        return P;
+    }
+
+    static void split_diagonal(const basic_csr_matrix<T> &A, basic_amg_level<T> &level) {
+        level.offsets.assign(1, 0);
+        level.columns.clear();
+        level.values.clear();
+        level.diagonal.assign(A.size(), 0);
+
+        for (uint32_t i = 0; i < A.size(); i++) {
+            for (auto k = A.offsets[i]; k < A.offsets[i + 1]; k++) {
+                if (A.columns[k] == i) {
+                    level.diagonal[i] += A.values[k];
+                } else {
+                    level.columns.push_back(A.columns[k]);
+                    level.values.push_back(A.values[k]);
+                }
+            }
+            level.offsets.push_back(level.columns.size());
+        }
+    }
+
+    void smooth(basic_amg_level<T> &level, thread_pool &pool) {
+        const auto A = level.view();
+        for (uint32_t s = 0; s < options.smoothingSteps; s++) {
+            pool.parallel_for(level.size(), [&](size_t start, size_t end) {
+                for (auto i = start; i < end; i++) {
+                    level.r[i] = level.b[i] - A.row_dot(level.x.data(), i);
+                }
+            });
+            pool.parallel_for(level.size(), [&](size_t start, size_t end) {
+                for (auto i = start; i < end; i++) {
+                    level.x[i] += level.omega * level.r[i] / level.diagonal[i];
+                }
+            });
+        }
+    }
+
+    void cycle(size_t l, thread_pool &pool) {
+        auto &level = levels[l];
+        if (l + 1 == levels.size()) {
+            if (coarsest.factored()) {
+                coarsest.solve(level.b.data(), level.x.data(), pool);
+            } else {
+                smooth(level, pool);
+            }
+            return;
+        }
+
+        smooth(level, pool);
+
+        const auto A = level.view();
+        pool.parallel_for(level.size(), [&](size_t start, size_t end) {
+            for (auto i = start; i < end; i++) {
+                level.r[i] = level.b[i] - A.row_dot(level.x.data(), i);
+            }
+        });
+
+        auto &next = levels[l + 1];
+        const auto &R = level.restriction;
+        pool.parallel_for(next.size(), [&](size_t start, size_t end) {
+            for (auto i = start; i < end; i++) {
+                T sum = 0;
+                for (auto k = R.offsets[i]; k < R.offsets[i + 1]; k++) {
+                    sum += R.values[k] * level.r[R.columns[k]];
+                }
+                next.b[i] = sum;
+                next.x[i] = 0;
+            }
+        });
+
+        cycle(l + 1, pool);
+
+        const auto &P = level.prolongation;
+        pool.parallel_for(level.size(), [&](size_t start, size_t end) {
+            for (auto i = start; i < end; i++) {
+                T sum = 0;
+                for (auto k = P.offsets[i]; k < P.offsets[i + 1]; k++) {
+                    sum += P.values[k] * next.x[P.columns[k]];
+                }
+                level.x[i] += sum;
+            }
+        });
+
+        smooth(level, pool);
+    }
+};
+
+typedef basic_amg<F> amg;
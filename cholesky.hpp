@@ -0,0 +1,321 @@
+#pragma once
+
+#include <vector>
+#include <span>
+#include <algorithm>
+#include <cmath>
+#include <cstdint>
+
+#include "model.hpp"
+#include "sparse.hpp"
+#include "thread_pool.hpp"
+
+// Sparse LDL^T factorization of a symmetric positive definite csr_view, for systems that are solved many times with
+// the same matrix. The rows are first permuted by nested dissection, which keeps the fill of mesh matrices near
+// n log n and makes the elimination tree bushy. The factor is computed once, after that a solve is a forward and a
+// backward substitution. Both substitutions are level scheduled: every row only depends on rows of lower levels, so
+// the rows of one level are solved in parallel.
+
+// Nested dissection ordering of the graph given by offsets and columns, order[k] being the k-th vertex to eliminate.
+// Every subgraph is split by the middle level of a breadth-first level structure rooted at a pseudo-peripheral vertex.
+// The two halves are ordered first, recursively, and the separator last. Subgraphs of up to leaf_size vertices keep
+// their order.
+std::vector<uint32_t> nested_dissection(std::span<const uint32_t> offsets, std::span<const uint32_t> columns,
+                                        uint32_t leaf_size = 16) {
+    const uint32_t n = offsets.size() - 1;
+
+    std::vector<uint32_t> order(n);
+    for (uint32_t i = 0; i < n; i++) order[i] = i;
+
+    // part[v] identifies the subgraph v currently belongs to, level[v] is scratch for the level structures.
+    std::vector<uint32_t> part(n, 0);
+    std::vector<uint32_t> level(n, invalid_index);
+    std::vector<uint32_t> visit;
+    uint32_t parts = 1;
+
+    struct range {
+        uint32_t begin, end;
+    };
+    std::vector<range> stack{{0, n}};
+
+    auto bfs = [&](uint32_t start, uint32_t p) {
+        visit.assign(1, start);
+        level[start] = 0;
+        for (size_t head = 0; head < visit.size(); head++) {
+            const auto vi = visit[head];
+            for (auto k = offsets[vi]; k < offsets[vi + 1]; k++) {
+                const auto ni = columns[k];
+                if (part[ni] != p || level[ni] != invalid_index) continue;
+                level[ni] = level[vi] + 1;
+                visit.push_back(ni);
+            }
+        }
+    };
+    auto clear_levels = [&]() {
+        for (const auto &vi : visit) level[vi] = invalid_index;
+    };
+    // Queues a subgraph for dissection under a new part.
+    auto push = [&](uint32_t begin, uint32_t end) {
+        if (end - begin <= leaf_size) return;
+        for (auto i = begin; i < end; i++) part[order[i]] = parts;
+        parts++;
+        stack.push_back({begin, end});
+    };
+
+    while (!stack.empty()) {
+        const auto [begin, end] = stack.back();
+        stack.pop_back();
+        const auto size = end - begin;
+        const auto p = part[order[begin]];
+
+        // Two sweeps towards a pseudo-peripheral vertex.
+        bfs(order[begin], p);
+        for (int sweep = 0; sweep < 2 && visit.size() == size; sweep++) {
+            const auto far = visit.back();
+            clear_levels();
+            bfs(far, p);
+        }
+
+        if (visit.size() < size) {
+            // Disconnected: the reached component and the rest are independent subgraphs.
+            const auto reached = uint32_t(visit.size());
+            std::stable_partition(order.begin() + begin, order.begin() + end,
+                                  [&](uint32_t vi) { return level[vi] != invalid_index; });
+            clear_levels();
+            push(begin, begin + reached);
+            push(begin + reached, end);
+            continue;
+        }
+
+        const auto middle = level[visit[size / 2]];
+        if (middle == 0) {
+            clear_levels();
+            continue;
+        }
+
+        // Below the separator, above it, then the separator itself.
+        std::stable_partition(order.begin() + begin, order.begin() + end,
+                              [&](uint32_t vi) { return level[vi] != middle; });
+        const auto below = std::stable_partition(order.begin() + begin, order.begin() + end,
+                                                 [&](uint32_t vi) { return level[vi] < middle; });
+        const auto separator = std::find_if(below, order.begin() + end,
+                                            [&](uint32_t vi) { return level[vi] == middle; });
+        clear_levels();
+
+        const auto lower_end = uint32_t(below - order.begin());
+        const auto upper_end = uint32_t(separator - order.begin());
+        for (auto i = upper_end; i < end; i++) part[order[i]] = invalid_index;
+        push(begin, lower_end);
+        push(lower_end, upper_end);
+    }
+
+    return order;
+}
+
+template<typename T>
+class basic_ldlt {
+public:
+    // Factors P A P^T = L D L^T with P from nested_dissection. Returns false if a pivot vanishes, which does not
+    // happen for positive definite matrices, and leaves the object unfactored.
+    bool factor(const basic_csr_view<T> &A) {
+        const uint32_t n = A.size();
+        order = nested_dissection(A.offsets, A.columns);
+
+        std::vector<uint32_t> inverse(n);
+        for (uint32_t k = 0; k < n; k++) inverse[order[k]] = k;
+
+        // Symbolic: elimination tree and column counts, walking every row's pattern up the tree until it meets a
+        // vertex already flagged for that row.
+        std::vector<uint32_t> parent(n), counts(n, 0), flag(n);
+        for (uint32_t k = 0; k < n; k++) {
+            parent[k] = invalid_index;
+            flag[k] = k;
+            const auto row = order[k];
+            for (auto p = A.offsets[row]; p < A.offsets[row + 1]; p++) {
+                for (auto i = inverse[A.columns[p]]; i < k && flag[i] != k; i = parent[i]) {
+                    if (parent[i] == invalid_index) parent[i] = k;
+                    counts[i]++;
+                    flag[i] = k;
+                }
+            }
+        }
+
+        columnOffsets.resize(n + 1);
+        columnOffsets[0] = 0;
+        for (uint32_t k = 0; k < n; k++) {
+            columnOffsets[k + 1] = columnOffsets[k] + counts[k];
+        }
+        rowIndices.resize(columnOffsets[n]);
+        columnValues.resize(columnOffsets[n]);
+        invDiagonal.resize(n);
+
+        // Numeric, up-looking: row k of L is the solution of a triangular system over the rows of its pattern, which
+        // are visited in topological order of the elimination tree.
+        std::vector<T> y(n, 0);
+        std::vector<uint32_t> pattern(n);
+        std::vector<T> diagonal(n);
+        std::fill(counts.begin(), counts.end(), 0);
+        std::fill(flag.begin(), flag.end(), invalid_index);
+        for (uint32_t k = 0; k < n; k++) {
+            const auto row = order[k];
+            auto top = n;
+            flag[k] = k;
+
+            y[k] = A.diagonal[row];
+            for (auto p = A.offsets[row]; p < A.offsets[row + 1]; p++) {
+                auto i = inverse[A.columns[p]];
+                if (i > k) continue;
+                y[i] += A.values[p];
+
+                uint32_t length = 0;
+                for (; flag[i] != k; i = parent[i]) {
+                    pattern[length++] = i;
+                    flag[i] = k;
+                }
+                while (length > 0) pattern[--top] = pattern[--length];
+            }
+
+            T d = y[k];
+            y[k] = 0;
+            for (; top < n; top++) {
+                const auto i = pattern[top];
+                const auto yi = y[i];
+                y[i] = 0;
+
+                const auto end = columnOffsets[i] + counts[i];
+                for (auto p = columnOffsets[i]; p < end; p++) {
+                    y[rowIndices[p]] -= columnValues[p] * yi;
+                }
+
+                const auto l = yi / diagonal[i];
+                d -= l * yi;
+                rowIndices[end] = k;
+                columnValues[end] = l;
+                counts[i]++;
+            }
+
+            if (d == 0 || !std::isfinite(d)) {
+                order.clear();
+                levelOffsets.clear();
+                return false;
+            }
+            diagonal[k] = d;
+            invDiagonal[k] = 1 / d;
+        }
+
+        // Row storage of L for the forward substitution, so both substitutions gather instead of scatter.
+        rowOffsets.assign(n + 1, 0);
+        for (const auto &i : rowIndices) rowOffsets[i + 1]++;
+        for (uint32_t k = 0; k < n; k++) rowOffsets[k + 1] += rowOffsets[k];
+        columnIndices.resize(rowIndices.size());
+        rowValues.resize(rowIndices.size());
+        auto positions = rowOffsets;
+        for (uint32_t j = 0; j < n; j++) {
+            for (auto p = columnOffsets[j]; p < columnOffsets[j + 1]; p++) {
+                const auto q = positions[rowIndices[p]]++;
+                columnIndices[q] = j;
+                rowValues[q] = columnValues[p];
+            }
+        }
+
+        // Level of a row: one above the highest level among the rows it depends on.
+        std::vector<uint32_t> levels(n, 0);
+        uint32_t level_count = 0;
+        for (uint32_t k = 0; k < n; k++) {
+            for (auto p = rowOffsets[k]; p < rowOffsets[k + 1]; p++) {
+                levels[k] = std::max(levels[k], levels[columnIndices[p]] + 1);
+            }
+            level_count = std::max(level_count, levels[k] + 1);
+        }
+        levelOffsets.assign(level_count + 1, 0);
+        for (const auto &l : levels) levelOffsets[l + 1]++;
+        for (uint32_t l = 0; l < level_count; l++) levelOffsets[l + 1] += levelOffsets[l];
+        levelRows.resize(n);
+        positions = levelOffsets;
+        for (uint32_t k = 0; k < n; k++) levelRows[positions[levels[k]]++] = k;
+
+        work.resize(n);
+        return true;
+    }
+
+    bool factored() const { return !levelOffsets.empty(); }
+
+    size_t size() const { return order.size(); }
+
+    size_t nonzeros() const { return factored() ? rowIndices.size() : 0; }
+
+    size_t level_count() const { return factored() ? levelOffsets.size() - 1 : 0; }
+
+    // x = A^-1 b. x and b may alias. Does nothing if the object is not factored.
+    template<typename X, typename Y>
+    void solve(const X *b, Y *x, thread_pool &pool) {
+        if (!factored()) return;
+        const auto n = size();
+        const auto y = work.data();
+
+        pool.parallel_for(n, [&](size_t start, size_t end) {
+            for (auto k = start; k < end; k++) y[k] = T(b[order[k]]);
+        });
+
+        // L y = P b.
+        for_each_level(false, pool, [&](uint32_t k) {
+            T sum = y[k];
+            for (auto p = rowOffsets[k]; p < rowOffsets[k + 1]; p++) {
+                sum -= rowValues[p] * y[columnIndices[p]];
+            }
+            y[k] = sum;
+        });
+
+        // L^T z = D^-1 y.
+        for_each_level(true, pool, [&](uint32_t k) {
+            T sum = y[k] * invDiagonal[k];
+            for (auto p = columnOffsets[k]; p < columnOffsets[k + 1]; p++) {
+                sum -= columnValues[p] * y[rowIndices[p]];
+            }
+            y[k] = sum;
+        });
+
+        pool.parallel_for(n, [&](size_t start, size_t end) {
+            for (auto k = start; k < end; k++) x[order[k]] = Y(y[k]);
+        });
+    }
+
+private:
+    // order[k] is the row of A that is pivot k.
+    std::vector<uint32_t> order;
+    // Strictly lower part of L by columns and by rows, the unit diagonal is implied.
+    std::vector<uint32_t> columnOffsets;
+    std::vector<uint32_t> rowIndices;
+    std::vector<T> columnValues;
+    std::vector<uint32_t> rowOffsets;
+    std::vector<uint32_t> columnIndices;
+    std::vector<T> rowValues;
+    std::vector<T> invDiagonal;
+    // Pivots grouped by level.
+    std::vector<uint32_t> levelOffsets;
+    std::vector<uint32_t> levelRows;
+    std::vector<T> work;
+
+    // Runs row(k) for the rows of every level, levels in increasing or decreasing order. Levels too narrow to be worth
+    // a dispatch run on the calling thread.
+    template<typename Row>
+    void for_each_level(bool reverse, thread_pool &pool, const Row &row) const {
+        constexpr uint32_t parallel_width = 2048;
+        const auto levels = level_count();
+
+        for (uint32_t i = 0; i < levels; i++) {
+            const auto l = reverse ? levels - 1 - i : i;
+            const auto begin = levelOffsets[l], end = levelOffsets[l + 1];
+
+            if (end - begin < parallel_width || pool.size() == 1) {
+                for (auto r = begin; r < end; r++) row(levelRows[r]);
+            } else {
+                pool.parallel_for(end - begin, [&](size_t start, size_t stop) {
+                    for (auto r = begin + start; r < begin + stop; r++) row(levelRows[r]);
+                });
+            }
+        }
+    }
+};
+
+typedef basic_ldlt<F> ldlt;
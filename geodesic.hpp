@@ -0,0 +1,163 @@
+#pragma once
+
+#include <vector>
+#include <array>
+#include <span>
+#include <algorithm>
+#include <cmath>
+#include <cstdint>
+
+#include <glm/glm.hpp>
+
+#include "model.hpp"
+#include "laplacian.hpp"
+#include "thread_pool.hpp"
+#include "solver.hpp"
+#include "cholesky.hpp"
+
+// Geodesic distance by the heat method (Crane, Weischedel and Wardetzky 2013): heat u diffused from the sources for a
+// short time t, the normalized field X = -grad u / |grad u| per face, then the distance phi from L phi = div X. Both
+// systems are factored once by build, after that every query is two pairs of LDL^T substitutions plus a pass over the
+// faces. The heat solution decays by a roughly constant factor per ring of vertices, which underflows single
+// precision a few dozen rings from the source, so the class is used in double.
+
+struct geodesic_options {
+    // t = timeScale * h^2 with h the mean edge length, as recommended in the paper.
+    double timeScale = 1;
+    // The Laplacian is singular (constants), the Poisson system is regularized by shift M with shift relative to the
+    // mean of diag(-L) / M.
+    double shift = 1e-10;
+};
+
+template<typename T>
+class basic_heat_geodesics {
+public:
+    // positions and indices are the triangles the operator was built from and have to outlive the object. Returns
+    // false if either system cannot be factored, distance must not be called then.
+    template<typename U>
+    bool build(std::span<const glm::vec3> positions, std::span<const uint32_t> indices, const basic_laplacian<U> &op,
+               thread_pool &pool, const geodesic_options &options = {}) {
+        this->positions = positions;
+        this->indices = indices;
+        const auto n = op.size();
+        const auto face_count = indices.size() / 3;
+
+        // The operator averages the cotangents of an edge over the faces sharing it, so the divergence weighs every
+        // face's contribution to an edge by 1 / faces on that edge as well, which keeps it the adjoint of the
+        // gradient under L.
+        std::vector<uint8_t> edge_faces(op.columns.size(), 0);
+        auto slot = [&](uint32_t i, uint32_t j) {
+            const auto begin = op.columns.begin() + op.offsets[i], end = op.columns.begin() + op.offsets[i + 1];
+            return uint32_t(std::find(begin, end, j) - op.columns.begin());
+        };
+        double edge_length = 0;
+        for (size_t f = 0; f < face_count; f++) {
+            for (int c = 0; c < 3; c++) {
+                const auto i = indices[3 * f + c], j = indices[3 * f + (c + 1) % 3];
+                edge_faces[slot(i, j)]++;
+                edge_faces[slot(j, i)]++;
+                edge_length += glm::distance(vec(positions[i]), vec(positions[j]));
+            }
+        }
+        const auto h = edge_length / double(3 * face_count);
+
+        // Weight of the edge opposite every corner.
+        edgeWeights.resize(3 * face_count);
+        pool.parallel_for(face_count, [&](size_t start, size_t end) {
+            for (auto f = start; f < end; f++) {
+                const auto p = corners(f);
+                for (int c = 0; c < 3; c++) {
+                    const auto a = p[(c + 1) % 3] - p[c];
+                    const auto b = p[(c + 2) % 3] - p[c];
+                    const auto cot = glm::dot(a, b) / glm::length(glm::cross(a, b));
+                    const auto i = indices[3 * f + (c + 1) % 3], j = indices[3 * f + (c + 2) % 3];
+                    edgeWeights[3 * f + c] = cot / T(edge_faces[slot(i, j)]);
+                }
+            }
+        });
+
+        double stiffness = 0, mass = 0;
+        for (size_t vi = 0; vi < n; vi++) {
+            mass += 1 / double(op.invMass[vi]);
+            for (auto k = op.offsets[vi]; k < op.offsets[vi + 1]; k++) stiffness += double(op.weights[k]);
+        }
+
+        // (M - t L) u = delta and (shift M - L) phi = -div X.
+        if (!heat.factor(build_system_matrix(op, T(1), T(options.timeScale * h * h), pool).view()) ||
+            !poisson.factor(build_system_matrix(op, T(options.shift * stiffness / mass), T(1), pool).view())) {
+            return false;
+        }
+
+        u.resize(n);
+        divergence.resize(n);
+        field.resize(face_count);
+        return true;
+    }
+
+    size_t size() const { return u.size(); }
+
+    // Distance of every vertex to the nearest of sources, 0 at the closest source. sources must not be empty.
+    template<typename Y>
+    void distance(std::span<const uint32_t> sources, Y *distances, thread_pool &pool) {
+        const auto n = size();
+        const auto face_count = field.size();
+
+        std::fill(u.begin(), u.end(), T(0));
+        for (const auto &s : sources) u[s] = 1;
+        heat.solve(u.data(), u.data(), pool);
+
+        // X = -grad u / |grad u|. Within a face grad u is sum_c u_c N x e_c / 2A with e_c the edge opposite c, only
+        // its direction is needed.
+        pool.parallel_for(face_count, [&](size_t start, size_t end) {
+            for (auto f = start; f < end; f++) {
+                const auto p = corners(f);
+                const auto normal = glm::cross(p[1] - p[0], p[2] - p[0]);
+
+                vec gradient(0);
+                for (int c = 0; c < 3; c++) {
+                    gradient += u[indices[3 * f + c]] * glm::cross(normal, p[(c + 2) % 3] - p[(c + 1) % 3]);
+                }
+                const auto length = glm::length(gradient);
+                field[f] = length > 0 ? -gradient / length : vec(0);
+            }
+        });
+
+        // div X at i is the sum over the edges ij of every face of weight * (p_j - p_i) . X, the discrete adjoint of
+        // the gradient under L. Accumulated negated, as the right hand side of (shift M - L) phi.
+        std::fill(divergence.begin(), divergence.end(), T(0));
+        for (size_t f = 0; f < face_count; f++) {
+            const auto p = corners(f);
+            for (int c = 0; c < 3; c++) {
+                const auto i = indices[3 * f + (c + 1) % 3], j = indices[3 * f + (c + 2) % 3];
+                const auto flux = edgeWeights[3 * f + c] * glm::dot(p[(c + 2) % 3] - p[(c + 1) % 3], field[f]);
+                divergence[i] -= flux;
+                divergence[j] += flux;
+            }
+        }
+        poisson.solve(divergence.data(), divergence.data(), pool);
+
+        T shift = divergence[sources[0]];
+        for (const auto &s : sources) shift = std::min(shift, divergence[s]);
+        pool.parallel_for(n, [&](size_t start, size_t end) {
+            for (auto vi = start; vi < end; vi++) distances[vi] = Y(divergence[vi] - shift);
+        });
+    }
+
+private:
+    typedef glm::vec<3, T> vec;
+
+    std::span<const glm::vec3> positions;
+    std::span<const uint32_t> indices;
+    std::vector<T> edgeWeights;
+    basic_ldlt<T> heat;
+    basic_ldlt<T> poisson;
+    std::vector<T> u;
+    std::vector<T> divergence;
+    std::vector<vec> field;
+
+    std::array<vec, 3> corners(size_t f) const {
+        return {vec(positions[indices[3 * f]]), vec(positions[indices[3 * f + 1]]), vec(positions[indices[3 * f + 2]])};
+    }
+};
+
+typedef basic_heat_geodesics<double> heat_geodesics;
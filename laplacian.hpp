@@ -0,0 +1,190 @@
+#pragma once
+
+#include <span>
+#include <vector>
+#include <array>
+#include <glm/glm.hpp>
+
+#include "model.hpp"
+#include "sparse.hpp"
+#include "thread_pool.hpp"
+
+// Non-owning view of the cotangent Laplacian. Row vi couples vertex vi to columns[offsets[vi]..offsets[vi + 1])
+// with the matching symmetric weights, scaled by invMass[vi]. values and diagonal hold the assembled M^-1 L, the
+// operator the explicit step applies. The arrays live either in a laplacian_data or in a mapped mesh cache.
+template<typename T>
+struct basic_laplacian {
+    std::span<const uint32_t> offsets;
+    std::span<const uint32_t> columns;
+    std::span<const T> weights;
+    std::span<const T> invMass;
+    std::span<const T> values;
+    std::span<const T> diagonal;
+
+    size_t size() const { return invMass.size(); }
+
+    basic_csr_view<T> matrix() const { return {offsets, columns, values, diagonal}; }
+};
+
+template<typename T>
+struct basic_laplacian_data {
+    std::vector<T> weights;
+    std::vector<T> invMass;
+    std::vector<T> values;
+    std::vector<T> diagonal;
+};
+
+typedef basic_laplacian<F> laplacian;
+typedef basic_laplacian_data<F> laplacian_data;
+
+enum class mass_type : uint8_t {
+    // A third of every incident triangle.
+    barycentric,
+    // Mixed Voronoi areas (Meyer et al.), the Voronoi region inside non-obtuse triangles and a half or a quarter of
+    // obtuse ones.
+    voronoi,
+};
+
+struct laplacian_options {
+    mass_type mass = mass_type::barycentric;
+
+    // The options packed for keying caches, see hash_settings.
+    uint64_t settings() const {
+        return uint64_t(mass);
+    }
+};
+
+// Corners incident to every vertex in CSR form, a corner being 3 * face + position in the face.
+void build_vertex_corners(const model &m, std::vector<uint32_t> &offsets, std::vector<uint32_t> &corners) {
+    offsets.assign(m.vertices.size() + 1, 0);
+    for (const auto &i : m.indices) {
+        offsets[i + 1]++;
+    }
+    for (size_t vi = 0; vi < m.vertices.size(); vi++) {
+        offsets[vi + 1] += offsets[vi];
+    }
+
+    auto fill = std::vector<uint32_t>(offsets.begin(), offsets.end() - 1);
+    corners.resize(m.indices.size());
+    for (uint32_t c = 0; c < m.indices.size(); c++) {
+        corners[fill[m.indices[c]]++] = c;
+    }
+}
+
+// Builds the cotangent weights (aligned with model::neighborIndices) and the inverse lumped vertex areas in two
+// parallel passes. The face pass computes the cotangent of every corner once, as dot / |cross|, along with the share
+// of the face area that goes to each corner. The vertex pass gathers those into the vertex's own row, so no two
+// threads write the same entry and the sums do not depend on the thread count. An edge weight is the mean of the
+// cotangents opposite it.
+// The geometry is promoted to T before any arithmetic, so a double operator is built in double throughout.
+template<typename T>
+void calculate_cotan_operator(const model &m, std::vector<T> &weights, std::vector<T> &invMass, thread_pool &pool,
+                              const laplacian_options &options = {}) {
+    typedef glm::vec<3, T> vec;
+
+    const auto face_count = m.indices.size() / 3;
+
+    // Cotangents at the three corners, then the area of the three corners.
+    std::vector<std::array<T, 6>> faces(face_count);
+    pool.parallel_for(face_count, [&](size_t start, size_t end) {
+        for (auto f = start; f < end; f++) {
+            const vec p[3] = {vec(m.vertices[m.indices[3 * f]]), vec(m.vertices[m.indices[3 * f + 1]]),
+                              vec(m.vertices[m.indices[3 * f + 2]])};
+            const auto double_area = glm::length(glm::cross(p[1] - p[0], p[2] - p[0]));
+
+            auto &face = faces[f];
+            for (int c = 0; c < 3; c++) {
+                const auto a = p[(c + 1) % 3] - p[c];
+                const auto b = p[(c + 2) % 3] - p[c];
+                face[c] = glm::dot(a, b) / glm::length(glm::cross(a, b));
+            }
+
+            if (options.mass == mass_type::barycentric) {
+                face[3] = face[4] = face[5] = double_area / 6;
+                continue;
+            }
+
+            const auto obtuse = face[0] < 0 ? 0 : face[1] < 0 ? 1 : face[2] < 0 ? 2 : -1;
+            for (int c = 0; c < 3; c++) {
+                if (obtuse == -1) {
+                    const auto a = p[(c + 1) % 3] - p[c];
+                    const auto b = p[(c + 2) % 3] - p[c];
+                    face[3 + c] = (glm::dot(a, a) * face[(c + 2) % 3] + glm::dot(b, b) * face[(c + 1) % 3]) / 8;
+                } else {
+                    face[3 + c] = double_area / (obtuse == c ? 4 : 8);
+                }
+            }
+        }
+    });
+
+    std::vector<uint32_t> corner_offsets, corners;
+    build_vertex_corners(m, corner_offsets, corners);
+
+    weights.assign(m.neighborIndices.size(), 0);
+    invMass.resize(m.vertices.size());
+
+    pool.parallel_for(m.vertices.size(), [&](size_t start, size_t end) {
+        std::vector<uint32_t> counts;
+
+        for (auto vi = start; vi < end; vi++) {
+            const auto row_offset = m.neighborOffsets[vi];
+            counts.assign(m.neighborOffsets[vi + 1] - row_offset, 0);
+
+            T Ai = 0;
+            for (auto k = corner_offsets[vi]; k < corner_offsets[vi + 1]; k++) {
+                const auto f = corners[k] / 3;
+                const auto c = corners[k] % 3;
+                const auto &face = faces[f];
+
+                // The edge to the next corner is opposite the previous corner and vice versa.
+                const auto next = m.neighbor_slot(vi, m.indices[3 * f + (c + 1) % 3]);
+                const auto previous = m.neighbor_slot(vi, m.indices[3 * f + (c + 2) % 3]);
+                weights[next] += face[(c + 2) % 3];
+                weights[previous] += face[(c + 1) % 3];
+                counts[next - row_offset]++;
+                counts[previous - row_offset]++;
+
+                Ai += face[3 + c];
+            }
+
+            for (size_t k = 0; k < counts.size(); k++) {
+                if (counts[k] > 1) weights[row_offset + k] /= T(counts[k]);
+            }
+
+            invMass[vi] = 1 / Ai;
+        }
+    });
+}
+
+// Folds the inverse masses into the weights: values[k] = invMass[vi] * weights[k] and the diagonal is minus the row
+// sum, so that (M^-1 L u)[vi] = sum_k weights[k] * (u[nk] - u[vi]) * invMass[vi] becomes a plain row product.
+template<typename T>
+void assemble_step_matrix(std::span<const uint32_t> offsets, std::span<const T> weights, std::span<const T> invMass,
+                          std::vector<T> &values, std::vector<T> &diagonal, thread_pool &pool) {
+    values.resize(weights.size());
+    diagonal.resize(invMass.size());
+
+    pool.parallel_for(invMass.size(), [&](size_t start, size_t end) {
+        for (auto vi = start; vi < end; vi++) {
+            T sum = 0;
+            for (auto k = offsets[vi]; k < offsets[vi + 1]; k++) {
+                values[k] = weights[k] * invMass[vi];
+                sum += weights[k];
+            }
+            diagonal[vi] = -sum * invMass[vi];
+        }
+    });
+}
+
+template<typename T = F>
+basic_laplacian_data<T> build_laplacian(const model &m, thread_pool &pool, const laplacian_options &options = {}) {
+    basic_laplacian_data<T> data;
+    calculate_cotan_operator(m, data.weights, data.invMass, pool, options);
+    assemble_step_matrix<T>(m.neighborOffsets, data.weights, data.invMass, data.values, data.diagonal, pool);
+    return data;
+}
+
+template<typename T>
+basic_laplacian<T> make_laplacian(const model &m, const basic_laplacian_data<T> &data) {
+    return {m.neighborOffsets, m.neighborIndices, data.weights, data.invMass, data.values, data.diagonal};
+}
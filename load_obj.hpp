@@ -3,119 +3,376 @@
 #include <string>
 #include <vector>
 #include <glm/glm.hpp>
-#include <map>
-#include <sstream>
-#include <set>
+#include <string_view>
+#include <charconv>
+#include <iostream>
+#include <algorithm>
+#include <array>
+#include <cstring>
 
+#include "mapped_file.hpp"
+#include "model.hpp"
+#include "reorder.hpp"
+#include "thread_pool.hpp"
 
-typedef float F;
-
-class model {
-public:
+// Raw OBJ records before vertex deduplication. corners holds three v/vt/vn triples per triangle, zero-based,
+// with -1 marking a missing attribute.
+struct obj_data {
     std::vector<glm::vec3> vertices;
     std::vector<glm::vec2> textureCoords;
     std::vector<glm::vec3> normals;
-    std::vector<uint32_t> indices;
-    std::map<uint32_t, std::set<uint32_t>> neighbors;
-    std::map<std::pair<uint32_t, uint32_t>, std::set<uint32_t>> edgeOpposites;
+    std::vector<std::array<int32_t, 3>> corners;
+    // Corner components that were given as negative (relative) indices, as corner * 3 + component. Relative
+    // indices resolve against the records seen so far, which a chunk parsed on its own has to rebase.
+    std::vector<size_t> relativeCorners;
+};
+
+enum class obj_weld : uint8_t {
+    // One vertex per position index, the attributes of its first corner win.
+    position,
+    // One vertex per distinct v/vt/vn triple, keeping texture and normal seams.
+    seams,
 };
 
-std::vector<std::string> split(const std::string &s, char delimiter) {
-    std::vector<std::string> tokens;
-    std::string token;
-    std::istringstream tokenStream(s);
-    while (std::getline(tokenStream, token, delimiter)) {
-        tokens.push_back(token);
+struct obj_options {
+    obj_weld weld = obj_weld::position;
+    // Positions closer than this are merged before corners are deduplicated, 0 disables.
+    F weldEpsilon = 0;
+    // Vertex renumbering applied after loading, for locality in the simulation.
+    vertex_order order = vertex_order::original;
+
+    // The options that change the loaded mesh packed into distinct bits, for keying caches.
+    uint64_t settings() const {
+        static_assert(sizeof(F) <= 6);
+        uint64_t epsilon_bits = 0;
+        std::memcpy(&epsilon_bits, &weldEpsilon, sizeof(weldEpsilon));
+        return epsilon_bits << 16 | uint64_t(order) << 8 | uint64_t(weld);
+    }
+};
+
+// In-place scanner over OBJ text, never allocates.
+struct obj_scanner {
+    const char *p;
+    const char *end;
+    uint8_t relative = 0;
+    bool valid = false;
+
+    bool at_line_end() const {
+        return p == end || *p == '\n' || *p == '\r' || *p == '#';
+    }
+
+    void skip_spaces() {
+        while (p != end && (*p == ' ' || *p == '\t')) p++;
+    }
+
+    void skip_line() {
+        while (p != end && *p != '\n') p++;
+        if (p != end) p++;
+    }
+
+    std::string_view token() {
+        skip_spaces();
+        auto begin = p;
+        while (p != end && *p != ' ' && *p != '\t' && *p != '\n' && *p != '\r') p++;
+        return {begin, size_t(p - begin)};
+    }
+
+    F read_float() {
+        skip_spaces();
+        if (p != end && *p == '+') p++;
+        F value = 0;
+        p = std::from_chars(p, end, value).ptr;
+        return value;
+    }
+
+    // Parses one OBJ index and resolves it to zero-based, negative indices count back from count.
+    int32_t read_index(size_t count, uint8_t component) {
+        int32_t value = 0;
+        auto result = std::from_chars(p, end, value);
+        if (result.ec != std::errc()) return -1;
+        p = result.ptr;
+        if (value < 0) {
+            relative |= 1 << component;
+            return int32_t(count) + value;
+        }
+        return value - 1;
+    }
+
+    // Reads one v/vt/vn corner. A token whose position index does not parse, or is the invalid absolute index 0, is
+    // skipped whole and leaves valid false. Relative indices are only resolved later, so they stay valid.
+    std::array<int32_t, 3> read_corner(const obj_data &data) {
+        skip_spaces();
+        relative = 0;
+        std::array<int32_t, 3> corner{-1, -1, -1};
+        const auto begin = p;
+        corner[0] = read_index(data.vertices.size(), 0);
+        valid = p != begin && (corner[0] >= 0 || relative & 1);
+        if (!valid) {
+            p = begin;
+            token();
+            return corner;
+        }
+        if (p != end && *p == '/') {
+            p++;
+            corner[1] = read_index(data.textureCoords.size(), 1);
+            if (p != end && *p == '/') {
+                p++;
+                corner[2] = read_index(data.normals.size(), 2);
+            }
+        }
+        return corner;
+    }
+};
+
+void parse_obj(std::string_view text, obj_data &data) {
+    obj_scanner s{text.data(), text.data() + text.size()};
+
+    auto push = [&](const std::array<int32_t, 3> &corner, uint8_t relative) {
+        for (uint8_t c = 0; c < 3; c++) {
+            if (relative & (1 << c)) data.relativeCorners.push_back(data.corners.size() * 3 + c);
+        }
+        data.corners.push_back(corner);
+    };
+
+    while (s.p != s.end) {
+        const auto c = s.token();
+
+        if (c == "v") {
+            auto x = s.read_float(), y = s.read_float(), z = s.read_float();
+            data.vertices.emplace_back(x, y, z);
+        } else if (c == "vt") {
+            auto x = s.read_float(), y = s.read_float();
+            data.textureCoords.emplace_back(x, y);
+        } else if (c == "vn") {
+            auto x = s.read_float(), y = s.read_float(), z = s.read_float();
+            data.normals.emplace_back(x, y, z);
+        } else if (c == "f") {
+            // Polygons are triangulated as a fan around their first corner. Corners that do not parse are dropped.
+            std::array<int32_t, 3> first{}, previous{};
+            uint8_t first_relative = 0, previous_relative = 0;
+            uint32_t count = 0;
+            while (s.skip_spaces(), !s.at_line_end()) {
+                const auto current = s.read_corner(data);
+                if (!s.valid) continue;
+
+                if (count == 0) {
+                    first = current;
+                    first_relative = s.relative;
+                } else if (count >= 2) {
+                    push(first, first_relative);
+                    push(previous, previous_relative);
+                    push(current, s.relative);
+                }
+                previous = current;
+                previous_relative = s.relative;
+                count++;
+            }
+        }
+
+        s.skip_line();
     }
-    return tokens;
 }
 
-model load_obj(std::string filename) {
-    std::vector<glm::vec3> vertices;
-    std::vector<glm::vec2> textureCoords;
-    std::vector<glm::vec3> normals;
-    std::vector<uint32_t> indices;
+// Splits text at line boundaries into a chunk per worker, parses the chunks on the pool and concatenates the results.
+// Record counts of earlier chunks are prefix-summed to place each chunk and to rebase its relative indices. Small
+// files are parsed on the calling thread.
+void parse_obj_parallel(std::string_view text, obj_data &data, thread_pool &pool) {
+    constexpr size_t min_chunk_size = 1 << 20;
+    const auto n = uint32_t(std::max<size_t>(1, std::min<size_t>(pool.size(), text.size() / min_chunk_size)));
+    if (n == 1) {
+        parse_obj(text, data);
+        return;
+    }
 
-    std::map<uint32_t, uint32_t> indexMap;
+    std::vector<std::string_view> chunks;
+    size_t begin = 0;
+    for (uint32_t i = 0; i < n; i++) {
+        auto end = i == n - 1 ? text.size() : std::max(begin, (i + 1) * (text.size() / n));
+        end = std::min(text.find('\n', end), text.size());
+        if (end < text.size()) end++;
+        chunks.push_back(text.substr(begin, end - begin));
+        begin = end;
+    }
 
-    model m;
+    std::vector<obj_data> parts(n);
+    pool.parallel_for(n, [&](size_t start, size_t end) {
+        for (auto i = start; i < end; i++) parse_obj(chunks[i], parts[i]);
+    });
 
-    auto parse_vertex = [&](const std::string &text) {
-        auto splits = split(text, '/');
+    struct offsets {
+        size_t vertices = 0, textureCoords = 0, normals = 0, corners = 0;
+    };
+    std::vector<offsets> prefix(n + 1);
+    for (uint32_t i = 0; i < n; i++) {
+        prefix[i + 1].vertices = prefix[i].vertices + parts[i].vertices.size();
+        prefix[i + 1].textureCoords = prefix[i].textureCoords + parts[i].textureCoords.size();
+        prefix[i + 1].normals = prefix[i].normals + parts[i].normals.size();
+        prefix[i + 1].corners = prefix[i].corners + parts[i].corners.size();
+    }
 
-        auto s = [](const std::string &s) {
-            if (s.empty()) return -1;
-            return std::stoi(s) - 1;
-        };
+    data.vertices.resize(prefix[n].vertices);
+    data.textureCoords.resize(prefix[n].textureCoords);
+    data.normals.resize(prefix[n].normals);
+    data.corners.resize(prefix[n].corners);
 
-        auto vi = s(splits[0]);
+    pool.parallel_for(n, [&](size_t start, size_t end) {
+        for (auto i = start; i < end; i++) {
+            const auto &part = parts[i];
+            const auto &o = prefix[i];
+            std::copy(part.vertices.begin(), part.vertices.end(), data.vertices.begin() + o.vertices);
+            std::copy(part.textureCoords.begin(), part.textureCoords.end(),
+                      data.textureCoords.begin() + o.textureCoords);
+            std::copy(part.normals.begin(), part.normals.end(), data.normals.begin() + o.normals);
+            std::copy(part.corners.begin(), part.corners.end(), data.corners.begin() + o.corners);
 
-        auto index = indexMap.find(vi);
-        if (index != indexMap.end()) {
-            return index->second;
+            const size_t rebase[3] = {o.vertices, o.textureCoords, o.normals};
+            for (const auto &r : part.relativeCorners) {
+                data.corners[o.corners + r / 3][r % 3] += int32_t(rebase[r % 3]);
+            }
         }
+    });
+}
 
-        auto ti = s(splits[1]);
-        auto ni = s(splits[2]);
+// Open-addressing hash map from an integer triple to an index, with linear probing. Sized up front for the
+// number of keys it will hold, never grows and never erases.
+class triple_index_map {
+public:
+    typedef std::array<int32_t, 3> key;
 
-        uint32_t i = m.vertices.size();
+    explicit triple_index_map(size_t expected) {
+        size_t capacity = 16;
+        while (capacity < expected * 2) capacity *= 2;
+        keys.resize(capacity);
+        values.assign(capacity, invalid_index);
+        mask = capacity - 1;
+    }
 
+    // Value slot of k, invalid_index if k was not present before.
+    uint32_t &operator[](const key &k) {
+        auto i = hash(k) & mask;
+        while (values[i] != invalid_index && keys[i] != k) {
+            i = (i + 1) & mask;
+        }
+        keys[i] = k;
+        return values[i];
+    }
 
-        if (vi != -1) m.vertices.emplace_back(vertices[vi]);
-        if (ti != -1) m.textureCoords.emplace_back(textureCoords[ti]);
-        if (ni != -1) m.normals.emplace_back(normals[ni]);
+private:
+    std::vector<key> keys;
+    std::vector<uint32_t> values;
+    size_t mask;
 
-        indexMap.insert({vi, i});
+    static size_t hash(const key &k) {
+        uint64_t h = uint32_t(k[0]) * 0x9e3779b97f4a7c15ull;
+        h = (h ^ uint32_t(k[1])) * 0xc2b2ae3d27d4eb4full;
+        h = (h ^ uint32_t(k[2])) * 0x165667b19e3779f9ull;
+        return h ^ (h >> 32);
+    }
+};
 
-        return i;
+// Maps every position to the first position within epsilon of it, using a uniform grid of epsilon sized cells.
+std::vector<uint32_t> weld_positions(const std::vector<glm::vec3> &positions, F epsilon) {
+    std::vector<uint32_t> representative(positions.size());
+    std::vector<uint32_t> next(positions.size(), invalid_index);
+    triple_index_map cells(positions.size());
+
+    auto cell_of = [&](const glm::vec3 &p) {
+        const auto c = glm::floor(p / epsilon);
+        return triple_index_map::key{int32_t(c.x), int32_t(c.y), int32_t(c.z)};
     };
 
-    std::ifstream t(filename);
+    for (uint32_t i = 0; i < positions.size(); i++) {
+        const auto &p = positions[i];
+        const auto cell = cell_of(p);
 
-    std::string line;
-    while (std::getline(t, line)) {
-        std::istringstream ss(line);
-        std::string c;
-        ss >> c;
+        representative[i] = i;
+        for (int32_t dx = -1; dx <= 1 && representative[i] == i; dx++) {
+            for (int32_t dy = -1; dy <= 1 && representative[i] == i; dy++) {
+                for (int32_t dz = -1; dz <= 1 && representative[i] == i; dz++) {
+                    auto j = cells[{cell[0] + dx, cell[1] + dy, cell[2] + dz}];
+                    for (; j != invalid_index; j = next[j]) {
+                        const auto d = positions[j] - p;
+                        if (glm::dot(d, d) <= epsilon * epsilon) {
+                            representative[i] = j;
+                            break;
+                        }
+                    }
+                }
+            }
+        }
 
-        if (c == "v") {
-            F x, y, z;
-            ss >> x >> y >> z;
-            vertices.emplace_back(x, y, z);
-        } else if (c == "vt") {
-            F x, y, z;
-            ss >> x >> y >> z;
-            textureCoords.emplace_back(x, y);
-        } else if (c == "vn") {
-            F x, y, z;
-            ss >> x >> y >> z;
-            normals.emplace_back(x, y, z);
-        } else if (c == "f") {
-            std::string a, b, c;
-            ss >> a >> b >> c;
+        if (representative[i] == i) {
+            auto &head = cells[cell];
+            next[i] = head;
+            head = i;
+        }
+    }
 
-            auto ai = parse_vertex(a);
-            auto bi = parse_vertex(b);
-            auto ci = parse_vertex(c);
+    return representative;
+}
+
+model build_model(const obj_data &data, const obj_options &options = {}) {
+    std::vector<uint32_t> representative;
+    if (options.weldEpsilon > 0) {
+        representative = weld_positions(data.vertices, options.weldEpsilon);
+    }
 
-            m.neighbors.insert({ai, std::set<uint32_t>()}).first->second.insert({bi, ci});
-            m.neighbors.insert({bi, std::set<uint32_t>()}).first->second.insert({ai, ci});
-            m.neighbors.insert({ci, std::set<uint32_t>()}).first->second.insert({ai, bi});
+    triple_index_map indexMap(data.corners.size());
 
-            m.indices.emplace_back(ai);
-            m.indices.emplace_back(bi);
-            m.indices.emplace_back(ci);
+    model m;
+
+    auto position = [&](const std::array<int32_t, 3> &corner) {
+        return corner[0] != -1 && !representative.empty() ? int32_t(representative[corner[0]]) : corner[0];
+    };
 
-            m.edgeOpposites.insert({{ai, bi}, std::set<uint32_t>()}).first->second.insert(ci);
-            m.edgeOpposites.insert({{bi, ci}, std::set<uint32_t>()}).first->second.insert(ai);
-            m.edgeOpposites.insert({{ci, ai}, std::set<uint32_t>()}).first->second.insert(bi);
+    auto parse_vertex = [&](const std::array<int32_t, 3> &corner) {
+        const auto vi = position(corner), ti = corner[1], ni = corner[2];
 
-            m.edgeOpposites.insert({{bi, ai}, std::set<uint32_t>()}).first->second.insert(ci);
-            m.edgeOpposites.insert({{ci, bi}, std::set<uint32_t>()}).first->second.insert(ai);
-            m.edgeOpposites.insert({{ai, ci}, std::set<uint32_t>()}).first->second.insert(bi);
+        auto &index = options.weld == obj_weld::position ? indexMap[{vi, -1, -1}] : indexMap[{vi, ti, ni}];
+        if (index != invalid_index) {
+            return index;
         }
+
+        uint32_t i = m.vertices.size();
+
+        if (vi != -1) m.vertices.emplace_back(data.vertices[vi]);
+        if (ti != -1) m.textureCoords.emplace_back(data.textureCoords[ti]);
+        if (ni != -1) m.normals.emplace_back(data.normals[ni]);
+
+        index = i;
+
+        return i;
+    };
+
+    m.indices.reserve(data.corners.size());
+    for (size_t c = 0; c + 2 < data.corners.size(); c += 3) {
+        // Welding can collapse a triangle onto an edge, drop those. Tested on the welded positions, before any of
+        // the corners becomes a vertex, so no vertex is left without faces and seams do not hide the collapse.
+        const auto pa = position(data.corners[c]);
+        const auto pb = position(data.corners[c + 1]);
+        const auto pc = position(data.corners[c + 2]);
+        if (pa == pb || pb == pc || pc == pa) continue;
+
+        m.indices.emplace_back(parse_vertex(data.corners[c]));
+        m.indices.emplace_back(parse_vertex(data.corners[c + 1]));
+        m.indices.emplace_back(parse_vertex(data.corners[c + 2]));
     }
 
+    build_topology(m);
+    reorder_vertices(m, options.order);
 
     return m;
-}
\ No newline at end of file
+}
+
+model load_obj(const std::string &filename, thread_pool &pool, const obj_options &options = {}) {
+    mapped_file file(filename);
+    if (!file.is_open()) {
+        std::cerr << "Could not open " << filename << std::endl;
+        return model();
+    }
+
+    obj_data data;
+    parse_obj_parallel(file.view(), data, pool);
+
+    return build_model(data, options);
+}
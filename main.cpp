@@ -9,15 +9,22 @@
 #include <glm/glm.hpp>
 #include <glm/gtc/matrix_transform.hpp>
 #include <glm/gtc/type_ptr.hpp>
-#include <glm/gtx/vector_angle.hpp>
-#include <glm/gtc/reciprocal.hpp>
 
 #include <string>
+#include <string_view>
+#include <charconv>
 #include <fstream>
 #include <streambuf>
-#include <thread>
+#include <memory>
+#include <functional>
+#include <span>
 
 #include "load_obj.hpp"
+#include "laplacian.hpp"
+#include "mesh_cache.hpp"
+#include "simulation.hpp"
+#include "spectral.hpp"
+#include "geodesic.hpp"
 
 static void error_callback(int error, const char *description) {
     std::cerr << "Error: " << description << std::endl;
@@ -74,149 +81,444 @@ bool check_program(GLuint program, std::string name) {
     return true;
 }
 
-void calculate_cot_sums_matrix(const model &m, std::map<std::pair<uint32_t, uint32_t>, F> &cot_sums_matrix) {
-    for (uint32_t vi = 0; vi < m.vertices.size(); vi++) {
-        const auto &v = m.vertices.at(vi);
-
-        for (const auto &ni : m.neighbors.at(vi)) {
-            const auto &n = m.vertices[ni];
-
-            auto nnis = std::set<uint32_t>();
-
-            const auto &vi_to_ni = m.edgeOpposites.at({vi, ni});
-            const auto &ni_to_vi = m.edgeOpposites.at({ni, vi});
-            nnis.insert(vi_to_ni.begin(), vi_to_ni.end());
-            nnis.insert(ni_to_vi.begin(), ni_to_vi.end());
-
-            F cot_sum = 0;
-            for (const auto &nni : nnis) {
-                const auto &nn = m.vertices[nni];
-                const auto &nn_to_v = v - nn;
-                const auto &nn_to_n = n - nn;
-                const auto theta = glm::angle(glm::normalize(nn_to_v), glm::normalize(nn_to_n));
-                cot_sum += glm::cot(theta);
+enum class step_mode {
+    // Explicit Euler on the SELL-C-sigma operator.
+    sell,
+    // Explicit Euler, temporally blocked, blockDepth steps per frame.
+    blocked,
+    // Explicit Euler on the valence-specialized operator.
+    valence,
+    // Explicit Euler on fields independent scenarios at once, field 0 is displayed.
+    batched,
+    // Backward Euler, one preconditioned CG solve or one pair of LDL^T substitutions per frame.
+    implicit,
+    // Explicit Euler on the CSR operator, rolling back to a checkpoint with a smaller dt when a step blows up.
+    adaptive,
+    // RKL2 super-time-stepping, as many operator passes per frame as dt needs to be stable.
+    rkl2,
+    // Heat evolution evaluated in closed form from the lowest eigenpairs, t advancing by dt per frame.
+    spectral,
+    // Wave equation, leapfrog on the CSR operator.
+    wave,
+    // Static geodesic distance from the source, by the heat method.
+    geodesic,
+};
+
+struct step_options {
+    step_mode mode = step_mode::sell;
+    // 0 picks the mode's default, 1e-2 for implicit, rkl2 and spectral and the estimated stability limit for the
+    // explicit and wave modes.
+    F dt = 0;
+    uint32_t blockDepth = 4;
+    uint32_t fields = 1;
+    implicit_options implicit;
+    uint32_t eigenpairs = 64;
+};
+
+enum class step_precision {
+    // fp32 state, operator and accumulation.
+    single,
+    // fp32 state and operator, fp64 accumulation.
+    mixed,
+    // fp64 throughout, the operator is rebuilt in fp64 from the model.
+    full,
+    // IEEE half state, fp32 operator and accumulation.
+    half,
+    // bfloat16 state, fp32 operator and accumulation.
+    brain,
+};
+
+// Advances the simulation by one frame and returns u as floats for the renderer.
+typedef std::function<std::span<const float>()> stepper;
+
+// Builds the stepping structures for state type S, operator type T and accumulation type A. The batched mode steps
+// op directly, so its arrays have to outlive the stepper.
+template<typename S, typename T, typename A>
+stepper make_stepper(const basic_laplacian<T> &op, std::span<const glm::vec3> vertices, const step_options &options,
+                     thread_pool &pool) {
+    struct data {
+        basic_sell_matrix<T> sell;
+        basic_temporal_blocking<T> blocking;
+        basic_valence_matrix<T> valence;
+        basic_simulation_state<S> state;
+        basic_simulation_batch<S> batch;
+        basic_implicit_step<T> implicit;
+        basic_adaptive_step<S, A> adaptive;
+        basic_rkl2_step<A> rkl2;
+        std::vector<float> display;
+    };
+
+    const auto mode = options.mode;
+    auto dt = A(options.dt);
+    if (dt == 0) {
+        const auto large = mode == step_mode::implicit || mode == step_mode::rkl2;
+        if (large) {
+            dt = A(0.01);
+        } else {
+            const auto estimate = estimate_time_step(op, pool);
+            dt = A(mode == step_mode::wave ? estimate.wave_dt() : estimate.dt());
+        }
+    }
+    const auto batched = mode == step_mode::batched;
+    const auto n = vertices.size();
+    const auto wave = mode == step_mode::wave;
+    auto d = std::make_shared<data>(data{{}, {}, {}, basic_simulation_state<S>(batched ? 0 : n, wave),
+                                         basic_simulation_batch<S>(batched ? n : 0, options.fields), {}, {}, {}, {}});
+    switch (mode) {
+        case step_mode::sell:
+            d->sell = build_sell(op.matrix());
+            break;
+        case step_mode::blocked:
+            d->blocking = build_temporal_blocking(op.matrix(), options.blockDepth);
+            break;
+        case step_mode::valence:
+            d->valence = build_valence_matrix(op.matrix());
+            break;
+        case step_mode::batched:
+            break;
+        case step_mode::implicit:
+            d->implicit = build_implicit_step(op, T(dt), pool, options.implicit);
+            if (d->implicit.options.solver != options.implicit.solver) {
+                std::cerr << "LDL^T factorization failed, falling back to CG" << std::endl;
             }
-            cot_sum /= nnis.size();
+            break;
+        case step_mode::adaptive:
+            d->adaptive.dt = dt;
+            break;
+        case step_mode::rkl2:
+            d->rkl2 = build_rkl2_step(n, dt, estimate_time_step(op, pool).dt());
+            break;
+        case step_mode::spectral:
+            // Built by make_spectral_stepper.
+            break;
+        case step_mode::wave:
+            break;
+        case step_mode::geodesic:
+            // Built by make_geodesic_stepper.
+            break;
+    }
 
-            cot_sums_matrix.insert({{ni, vi}, cot_sum});
-            cot_sums_matrix.insert({{vi, ni}, cot_sum});
+    if (batched) {
+        // Field 0 is the usual scenario, the others put their source at vertices spread over the mesh.
+        for (uint32_t f = 0; f < options.fields; f++) {
+            const auto source = f == 0 ? glm::vec3(1, 0, 0) : vertices[f * n / options.fields];
+            for (unsigned i = 0; i < n; i++) {
+                if (glm::distance(vertices[i], source) < 0.3) {
+                    d->batch.u()[i * options.fields + f] = S(20);
+                }
+            }
+        }
+    } else {
+        for (unsigned i = 0; i < n; i++) {
+            if(glm::distance(vertices[i], glm::vec3(1, 0, 0)) < 0.3) {
+                d->state.u()[i] = S(20);
+            }
         }
     }
-}
-
-void calculate_mass_matrix(const model &m, std::map<uint32_t, F> &mass_matrix) {
-    for (uint32_t vi = 0; vi < m.vertices.size(); vi++) {
-        const auto &v = m.vertices.at(vi);
-
-        F Ai = 0;
-        auto edges_done = std::set<std::pair<uint32_t, uint32_t>>();
-
-        for (const auto &ni : m.neighbors.at(vi)) {
-            const auto &n = m.vertices.at(ni);
-
-            auto nnis = std::set<uint32_t>();
 
-            const auto &vi_to_ni = m.edgeOpposites.at({vi, ni});
-            const auto &ni_to_vi = m.edgeOpposites.at({ni, vi});
-            nnis.insert(vi_to_ni.begin(), vi_to_ni.end());
-            nnis.insert(ni_to_vi.begin(), ni_to_vi.end());
+    if (batched || !std::is_same_v<S, float>) {
+        d->display.resize(n);
+    }
 
-            for (const auto &nni : nnis) {
-                if (edges_done.count({ni, nni}) > 0) {
-                    continue;
+    return [d, mode, dt, op, &pool]() -> std::span<const float> {
+        switch (mode) {
+            case step_mode::sell:
+                update_simulation(d->state, dt, d->sell, pool);
+                break;
+            case step_mode::blocked:
+                update_simulation(d->state, dt, d->blocking, pool);
+                break;
+            case step_mode::valence:
+                update_simulation(d->state, dt, d->valence, pool);
+                break;
+            case step_mode::batched: {
+                update_simulation(d->batch, dt, op, pool);
+                const auto &u = d->batch.u();
+                for (size_t i = 0; i < d->display.size(); i++) {
+                    d->display[i] = float(u[i * d->batch.fields()]);
                 }
-
-                const auto &nn = m.vertices[nni];
-                const auto &v_to_n = n - v;
-                const auto &v_to_nn = nn - v;
-                Ai += glm::length(glm::cross(v_to_n, v_to_nn)) / 6;
-                edges_done.emplace(ni, nni);
-                edges_done.emplace(nni, ni);
+                return d->display;
             }
+            case step_mode::implicit:
+                update_simulation(d->state, d->implicit, pool);
+                break;
+            case step_mode::adaptive:
+                update_simulation(d->state, d->adaptive, op, pool);
+                break;
+            case step_mode::rkl2:
+                update_simulation(d->state, d->rkl2, op, pool);
+                break;
+            case step_mode::spectral:
+                break;
+            case step_mode::wave:
+                update_wave(d->state, dt, op, pool);
+                break;
+            case step_mode::geodesic:
+                break;
         }
 
-        mass_matrix.insert({vi, 1 / Ai});
-    }
+        const auto &u = d->state.u();
+        if constexpr (std::is_same_v<S, float>) {
+            return u;
+        } else {
+            std::transform(u.begin(), u.end(), d->display.begin(), [](const S &x) { return float(x); });
+            return d->display;
+        }
+    };
 }
 
-void update_simulation_worker(const std::vector<F> &old_us, const std::vector<F> &old_vs, std::vector<F> &us,
-                              std::vector<F> &vs,
-                              const uint32_t start, const uint32_t end,
-                              const F &dt, const model &m,
-                              const std::map<std::pair<uint32_t, uint32_t>, F> &cot_sums_matrix,
-                              const std::map<uint32_t, F> &mass_matrix) {
-    for (uint32_t vi = start; vi < end; vi++) {
-        const auto &old_u = old_us.at(vi);
-        const auto &v = m.vertices.at(vi);
-
-        F sum = 0;
-        for (const auto &ni : m.neighbors.at(vi)) {
-            sum += cot_sums_matrix.at({ni, vi}) * (old_us.at(ni) - old_u);
+// Evaluates the heat equation in basis at t = dt, 2 dt, ... The basis has to outlive the stepper. Returns an empty
+// stepper for an empty basis.
+stepper make_spectral_stepper(const eigenbasis_view &basis, const laplacian &op, std::span<const glm::vec3> vertices,
+                              const step_options &options, thread_pool &pool) {
+    if (basis.count() == 0) return {};
+
+    struct data {
+        spectral_heat heat;
+        std::vector<float> u;
+        double t = 0;
+    };
+
+    const auto dt = options.dt != 0 ? double(options.dt) : 0.01;
+    const auto n = vertices.size();
+
+    std::vector<float> u0(n);
+    for (unsigned i = 0; i < n; i++) {
+        if (glm::distance(vertices[i], glm::vec3(1, 0, 0)) < 0.3) {
+            u0[i] = 20;
         }
+    }
 
-        const auto &L = sum * mass_matrix.at(vi);
-        us[vi] = old_u + L * dt;
+    auto d = std::make_shared<data>(data{project_heat(basis, op, u0.data(), pool), std::vector<float>(n)});
+    return [d, dt, &pool]() -> std::span<const float> {
+        d->t += dt;
+        evaluate_heat(d->heat, d->t, d->u.data(), pool);
+        return d->u;
+    };
+}
 
-//        const F vel = old_vs.at(vi) + L * dt;
-//        vs[vi] = vel;
-//        us[vi] = old_u + vel * dt;
+// Geodesic distance from the vertex closest to the usual source, computed once. vertices and indices have to outlive
+// the stepper. Returns an empty stepper if the heat method's systems cannot be factored.
+stepper make_geodesic_stepper(const laplacian &op, std::span<const glm::vec3> vertices,
+                              std::span<const uint32_t> indices, thread_pool &pool) {
+    struct data {
+        heat_geodesics geodesics;
+        std::vector<float> distances;
+    };
+
+    uint32_t source = 0;
+    for (uint32_t i = 0; i < vertices.size(); i++) {
+        if (glm::distance(vertices[i], glm::vec3(1, 0, 0)) < glm::distance(vertices[source], glm::vec3(1, 0, 0))) {
+            source = i;
+        }
     }
-}
 
-void update_simulation(std::vector<F> &us, std::vector<F> &vs, const F &dt, const model &m,
-                       const std::map<std::pair<uint32_t, uint32_t>, F> &cot_sums_matrix,
-                       const std::map<uint32_t, F> &mass_matrix) {
+    auto d = std::make_shared<data>();
+    if (!d->geodesics.build(vertices, indices, op, pool)) return {};
+    d->distances.resize(vertices.size());
+    d->geodesics.distance(std::span<const uint32_t>(&source, 1), d->distances.data(), pool);
 
-    const auto old_us = us;
-    const auto old_vs = vs;
+    return [d]() -> std::span<const float> { return d->distances; };
+}
 
-    uint32_t n = std::max(1u, std::thread::hardware_concurrency());
-    std::vector<std::thread> threads(n);
-    for (auto i = 0; i < n; i++) {
-        uint32_t batch_size = m.vertices.size() / n;
+static void print_usage(const char *program) {
+    std::cerr << "Usage: " << program << " [options] [file.obj]\n"
+              << "  --blocked[=depth]  --valence  --fields=count  --adaptive  --rkl2  --wave  --geodesic\n"
+              << "  --implicit[=jacobi|ic0|ldlt|amg|cg-amg]  --spectral[=count]  --dt=seconds\n"
+              << "  --precision=single|mixed|double|half|bfloat16\n"
+              << "  --weld=position|seams  --weld-epsilon=distance  --order=original|rcm|morton\n"
+              << "  --mass=barycentric|voronoi" << std::endl;
+}
 
-        auto start = i * batch_size;
-        auto end = (i + 1) * batch_size;
+// Parses all of text as a number, false if anything is left over.
+template<typename T>
+static bool parse_number(std::string_view text, T &value) {
+    const auto end = text.data() + text.size();
+    const auto result = std::from_chars(text.data(), end, value);
+    return result.ec == std::errc() && result.ptr == end;
+}
 
-        if (i == n - 1) {
-            end += m.vertices.size() % n;
+int main(int argc, char **argv) {
+    std::string filename = "torus.obj";
+    step_options stepping;
+    auto precision = step_precision::single;
+    obj_options options;
+    laplacian_options operator_options;
+
+    for (int i = 1; i < argc; i++) {
+        const std::string arg = argv[i];
+        if (arg == "--blocked") {
+            stepping.mode = step_mode::blocked;
+        } else if (arg.starts_with("--blocked=")) {
+            stepping.mode = step_mode::blocked;
+            if (!parse_number(std::string_view(arg).substr(10), stepping.blockDepth)) {
+                print_usage(argv[0]);
+                return EXIT_FAILURE;
+            }
+        } else if (arg == "--valence") {
+            stepping.mode = step_mode::valence;
+        } else if (arg == "--implicit" || arg == "--implicit=jacobi") {
+            stepping.mode = step_mode::implicit;
+            stepping.implicit.preconditioner = preconditioner_type::jacobi;
+        } else if (arg == "--implicit=ic0") {
+            stepping.mode = step_mode::implicit;
+            stepping.implicit.preconditioner = preconditioner_type::ic0;
+        } else if (arg == "--implicit=ldlt") {
+            stepping.mode = step_mode::implicit;
+            stepping.implicit.solver = implicit_solver::ldlt;
+        } else if (arg == "--implicit=amg") {
+            stepping.mode = step_mode::implicit;
+            stepping.implicit.solver = implicit_solver::amg;
+        } else if (arg == "--implicit=cg-amg") {
+            stepping.mode = step_mode::implicit;
+            stepping.implicit.preconditioner = preconditioner_type::amg;
+        } else if (arg == "--adaptive") {
+            stepping.mode = step_mode::adaptive;
+        } else if (arg == "--rkl2") {
+            stepping.mode = step_mode::rkl2;
+        } else if (arg == "--geodesic") {
+            stepping.mode = step_mode::geodesic;
+        } else if (arg == "--wave") {
+            stepping.mode = step_mode::wave;
+        } else if (arg == "--spectral") {
+            stepping.mode = step_mode::spectral;
+        } else if (arg.starts_with("--spectral=")) {
+            stepping.mode = step_mode::spectral;
+            if (!parse_number(std::string_view(arg).substr(11), stepping.eigenpairs)) {
+                print_usage(argv[0]);
+                return EXIT_FAILURE;
+            }
+            stepping.eigenpairs = std::max(1u, stepping.eigenpairs);
+        } else if (arg.starts_with("--dt=")) {
+            if (!parse_number(std::string_view(arg).substr(5), stepping.dt) || !std::isfinite(stepping.dt) ||
+                stepping.dt < 0) {
+                print_usage(argv[0]);
+                return EXIT_FAILURE;
+            }
+        } else if (arg.starts_with("--fields=")) {
+            stepping.mode = step_mode::batched;
+            if (!parse_number(std::string_view(arg).substr(9), stepping.fields)) {
+                print_usage(argv[0]);
+                return EXIT_FAILURE;
+            }
+            stepping.fields = std::max(1u, stepping.fields);
+        } else if (arg == "--precision=single") {
+            precision = step_precision::single;
+        } else if (arg == "--precision=mixed") {
+            precision = step_precision::mixed;
+        } else if (arg == "--precision=double") {
+            precision = step_precision::full;
+        } else if (arg == "--precision=half") {
+            precision = step_precision::half;
+        } else if (arg == "--precision=bfloat16") {
+            precision = step_precision::brain;
+        } else if (arg.starts_with("--precision=")) {
+            print_usage(argv[0]);
+            return EXIT_FAILURE;
+        } else if (arg == "--weld=position") {
+            options.weld = obj_weld::position;
+        } else if (arg == "--weld=seams") {
+            options.weld = obj_weld::seams;
+        } else if (arg.starts_with("--weld-epsilon=")) {
+            if (!parse_number(std::string_view(arg).substr(15), options.weldEpsilon) ||
+                !std::isfinite(options.weldEpsilon) || options.weldEpsilon < 0) {
+                print_usage(argv[0]);
+                return EXIT_FAILURE;
+            }
+        } else if (arg == "--order=original") {
+            options.order = vertex_order::original;
+        } else if (arg == "--order=rcm") {
+            options.order = vertex_order::rcm;
+        } else if (arg == "--order=morton") {
+            options.order = vertex_order::morton;
+        } else if (arg == "--mass=barycentric") {
+            operator_options.mass = mass_type::barycentric;
+        } else if (arg == "--mass=voronoi") {
+            operator_options.mass = mass_type::voronoi;
+        } else {
+            filename = arg;
         }
-
-        threads[i] = std::thread(update_simulation_worker, std::cref(old_us), std::cref(old_vs), std::ref(us),
-                                 std::ref(vs),
-                                 start, end, std::cref(dt), std::cref(m),
-                                 std::cref(cot_sums_matrix),
-                                 std::cref(mass_matrix));
     }
 
-    for (auto &t : threads) {
-        t.join();
-    }
-}
+    const auto cache_filename = filename + ".cache";
+    const auto source_hash = hash_file(filename);
+    const auto settings = hash_settings(options, operator_options);
 
-int main() {
-    auto model = load_obj("torus.obj");
+    model model;
+    thread_pool pool;
+    laplacian_data operators;
 
-    auto vertices = model.vertices;
-    auto normals = model.normals;
-    auto indices = model.indices;
+    auto cache = std::make_unique<mesh_cache>(cache_filename, source_hash, settings);
+    if (!cache->valid()) {
+        cache.reset();
 
-    auto u = std::vector<float>(vertices.size());
-    auto vels = std::vector<F>(vertices.size());
-    for (unsigned i = 0; i < vertices.size(); i++) {
-        u[i] = 0;
-        vels[i] = 0;
+        model = load_obj(filename, pool, options);
+        operators = build_laplacian(model, pool, operator_options);
 
-        if(glm::distance(model.vertices[i], glm::vec3(1, 0, 0)) < 0.3) {
-            u[i] = 20;
+        if (write_mesh_cache(cache_filename, source_hash, settings, make_mesh_view(model, operators))) {
+            cache = std::make_unique<mesh_cache>(cache_filename, source_hash, settings);
+            if (!cache->valid()) cache.reset();
         }
     }
 
-    std::map<std::pair<uint32_t, uint32_t>, F> cot_sums_matrix;
-    std::map<uint32_t, F> mass_matrix;
-
-    calculate_cot_sums_matrix(model, cot_sums_matrix);
-    calculate_mass_matrix(model, mass_matrix);
+    const auto mesh = cache ? cache->view() : make_mesh_view(model, operators);
+
+    const auto &vertices = mesh.vertices;
+    const auto &normals = mesh.normals;
+    const auto &indices = mesh.indices;
+
+    stepper step;
+    basic_laplacian_data<double> operators64;
+    std::unique_ptr<eigen_cache> eigen;
+    eigenbasis basis;
+    if (stepping.mode == step_mode::spectral) {
+        // The eigenbasis is F like the mesh cache, so the precision does not apply.
+        const auto eigen_filename = filename + ".eigen";
+        const auto n = vertices.size();
+        const auto count = std::min<size_t>(stepping.eigenpairs, n);
+        eigen = std::make_unique<eigen_cache>(eigen_filename, source_hash, settings, count, n);
+        if (!eigen->valid()) {
+            // Unmapped before the rename replaces the file, which fails on a mapped file on Windows.
+            eigen.reset();
+            basis = compute_eigenbasis<F>(mesh.op, uint32_t(count), pool);
+            if (!basis.values.empty()) write_eigen_cache(eigen_filename, source_hash, settings, count, basis.view());
+        }
+        step = make_spectral_stepper(eigen ? eigen->view() : basis.view(), mesh.op, vertices, stepping, pool);
+        if (!step) {
+            std::cerr << "Eigenbasis computation failed" << std::endl;
+            return EXIT_FAILURE;
+        }
+    } else if (stepping.mode == step_mode::geodesic) {
+        step = make_geodesic_stepper(mesh.op, vertices, indices, pool);
+        if (!step) {
+            std::cerr << "Geodesic factorization failed" << std::endl;
+            return EXIT_FAILURE;
+        }
+    } else {
+        switch (precision) {
+            case step_precision::single:
+                step = make_stepper<float, F, float>(mesh.op, vertices, stepping, pool);
+                break;
+            case step_precision::mixed:
+                step = make_stepper<float, F, double>(mesh.op, vertices, stepping, pool);
+                break;
+            case step_precision::full: {
+                // The cache only holds the F operator. Vertex order is deterministic, so a fresh load lines up with
+                // it.
+                if (model.vertices.empty()) model = load_obj(filename, pool, options);
+                operators64 = build_laplacian<double>(model, pool, operator_options);
+                step = make_stepper<double, double, double>(make_laplacian(model, operators64), vertices, stepping,
+                                                            pool);
+                break;
+            }
+            case step_precision::half:
+                step = make_stepper<half_float, F, float>(mesh.op, vertices, stepping, pool);
+                break;
+            case step_precision::brain:
+                step = make_stepper<bfloat16, F, float>(mesh.op, vertices, stepping, pool);
+                break;
+        }
+    }
 
     if (!glfwInit()) {
         std::cerr << "glfwInit failed!" << std::endl;
@@ -308,7 +610,7 @@ int main() {
         glfwGetFramebufferSize(window, &width, &height);
         F ratio = (F) width / (F) height;
 
-        update_simulation(u, vels, 0.0001f, model, cot_sums_matrix, mass_matrix);
+        const auto u = step();
 
         glBindBuffer(GL_ARRAY_BUFFER, u_buffer);
         glBufferData(GL_ARRAY_BUFFER, u.size() * sizeof(u[0]), u.data(), GL_DYNAMIC_DRAW);
@@ -0,0 +1,93 @@
+#pragma once
+
+#include <string>
+#include <string_view>
+#include <cstddef>
+
+#ifdef _WIN32
+#ifndef WIN32_LEAN_AND_MEAN
+#define WIN32_LEAN_AND_MEAN
+#endif
+#ifndef NOMINMAX
+#define NOMINMAX
+#endif
+#include <windows.h>
+#else
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+// Read-only view of a whole file mapped into memory. An empty or missing file yields an empty view,
+// is_open() tells the two apart.
+class mapped_file {
+public:
+    explicit mapped_file(const std::string &filename) {
+#ifdef _WIN32
+        file = CreateFileA(filename.c_str(), GENERIC_READ, FILE_SHARE_READ, nullptr, OPEN_EXISTING,
+                           FILE_FLAG_SEQUENTIAL_SCAN, nullptr);
+        if (file == INVALID_HANDLE_VALUE) return;
+        open = true;
+
+        LARGE_INTEGER file_size;
+        if (!GetFileSizeEx(file, &file_size) || file_size.QuadPart == 0) return;
+
+        mapping = CreateFileMappingA(file, nullptr, PAGE_READONLY, 0, 0, nullptr);
+        if (!mapping) return;
+
+        auto view = MapViewOfFile(mapping, FILE_MAP_READ, 0, 0, 0);
+        if (!view) return;
+
+        ptr = static_cast<const char *>(view);
+        length = file_size.QuadPart;
+#else
+        fd = ::open(filename.c_str(), O_RDONLY);
+        if (fd < 0) return;
+        open = true;
+
+        struct stat st{};
+        if (fstat(fd, &st) != 0 || st.st_size == 0) return;
+
+        auto view = mmap(nullptr, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+        if (view == MAP_FAILED) return;
+        madvise(view, st.st_size, MADV_SEQUENTIAL);
+
+        ptr = static_cast<const char *>(view);
+        length = st.st_size;
+#endif
+    }
+
+    ~mapped_file() {
+#ifdef _WIN32
+        if (ptr) UnmapViewOfFile(ptr);
+        if (mapping) CloseHandle(mapping);
+        if (file != INVALID_HANDLE_VALUE) CloseHandle(file);
+#else
+        if (ptr) munmap(const_cast<char *>(ptr), length);
+        if (fd >= 0) ::close(fd);
+#endif
+    }
+
+    mapped_file(const mapped_file &) = delete;
+    mapped_file &operator=(const mapped_file &) = delete;
+
+    bool is_open() const { return open; }
+
+    const char *data() const { return ptr; }
+
+    size_t size() const { return length; }
+
+    std::string_view view() const { return {ptr, length}; }
+
+private:
+    const char *ptr = nullptr;
+    size_t length = 0;
+    bool open = false;
+#ifdef _WIN32
+    HANDLE file = INVALID_HANDLE_VALUE;
+    HANDLE mapping = nullptr;
+#else
+    int fd = -1;
+#endif
+};
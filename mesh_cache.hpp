@@ -0,0 +1,208 @@
+#pragma once
+
+#include <string>
+#include <string_view>
+#include <vector>
+#include <span>
+#include <fstream>
+#include <filesystem>
+#include <cstring>
+
+#include "mapped_file.hpp"
+#include "load_obj.hpp"
+#include "laplacian.hpp"
+
+// Binary cache of a loaded mesh and its operators. The file is a header followed by 64 byte aligned flat arrays
+// that are used straight from the mapping, there is no deserialization step. A cache is only valid for the source
+// OBJ content it was built from (sourceHash) and for the build settings it was built with.
+
+constexpr char mesh_cache_magic[8] = {'S', 'T', 'M', 'E', 'S', 'H', 0, 0};
+constexpr uint32_t mesh_cache_version = 3;
+constexpr uint64_t mesh_cache_alignment = 64;
+
+enum mesh_cache_section : uint32_t {
+    section_vertices,
+    section_normals,
+    section_indices,
+    section_neighbor_offsets,
+    section_neighbor_indices,
+    section_weights,
+    section_inv_mass,
+    section_vertex_ids,
+    section_step_values,
+    section_step_diagonal,
+    section_count
+};
+
+struct mesh_cache_header {
+    char magic[8];
+    uint32_t version;
+    uint32_t scalarSize;
+    uint64_t sourceHash;
+    uint64_t settings;
+    struct {
+        uint64_t offset;
+        uint64_t size;
+    } sections[section_count];
+};
+
+// Everything the renderer and the simulation read, independent of where the arrays live.
+struct mesh_view {
+    std::span<const glm::vec3> vertices;
+    std::span<const glm::vec3> normals;
+    std::span<const uint32_t> indices;
+    // Load order IDs, see model::vertexIds.
+    std::span<const uint32_t> vertexIds;
+    laplacian op;
+};
+
+// 64 bit FNV-1a over 8 byte words.
+uint64_t hash_bytes(std::string_view bytes) {
+    constexpr uint64_t prime = 0x100000001b3ull;
+    uint64_t h = 0xcbf29ce484222325ull ^ bytes.size();
+
+    size_t i = 0;
+    for (; i + 8 <= bytes.size(); i += 8) {
+        uint64_t word;
+        std::memcpy(&word, bytes.data() + i, 8);
+        h = (h ^ word) * prime;
+    }
+    for (; i < bytes.size(); i++) {
+        h = (h ^ uint8_t(bytes[i])) * prime;
+    }
+
+    return h;
+}
+
+uint64_t hash_file(const std::string &filename) {
+    mapped_file file(filename);
+    return hash_bytes(file.view());
+}
+
+// Cache key of the settings a mesh and its operators are built with.
+uint64_t hash_settings(const obj_options &options, const laplacian_options &operator_options) {
+    const uint64_t fields[] = {options.settings(), operator_options.settings()};
+    return hash_bytes({reinterpret_cast<const char *>(fields), sizeof(fields)});
+}
+
+mesh_view make_mesh_view(const model &m, const laplacian_data &operators) {
+    return {m.vertices, m.normals, m.indices, m.vertexIds, make_laplacian(m, operators)};
+}
+
+class mesh_cache {
+public:
+    mesh_cache(const std::string &filename, uint64_t source_hash, uint64_t settings) : file(filename) {
+        if (file.size() < sizeof(mesh_cache_header)) return;
+
+        auto h = reinterpret_cast<const mesh_cache_header *>(file.data());
+        if (std::memcmp(h->magic, mesh_cache_magic, sizeof(mesh_cache_magic)) != 0) return;
+        if (h->version != mesh_cache_version || h->scalarSize != sizeof(F)) return;
+        if (h->sourceHash != source_hash || h->settings != settings) return;
+
+        for (const auto &s : h->sections) {
+            if (s.offset % mesh_cache_alignment != 0 || s.offset > file.size() || s.size > file.size() - s.offset) {
+                return;
+            }
+        }
+
+        header = h;
+
+        const auto v = view();
+        const auto n = v.vertices.size(), nonzeros = v.op.columns.size();
+        if (v.normals.size() != 0 && v.normals.size() != n) header = nullptr;
+        else if (v.vertexIds.size() != 0 && v.vertexIds.size() != n) header = nullptr;
+        else if (v.op.offsets.size() != n + 1 || v.op.invMass.size() != n) header = nullptr;
+        else if (v.op.weights.size() != nonzeros || v.op.offsets.back() != nonzeros) header = nullptr;
+        else if (v.op.values.size() != nonzeros || v.op.diagonal.size() != n) header = nullptr;
+    }
+
+    bool valid() const { return header != nullptr; }
+
+    mesh_view view() const {
+        return {
+                section<glm::vec3>(section_vertices),
+                section<glm::vec3>(section_normals),
+                section<uint32_t>(section_indices),
+                section<uint32_t>(section_vertex_ids),
+                {
+                        section<uint32_t>(section_neighbor_offsets),
+                        section<uint32_t>(section_neighbor_indices),
+                        section<F>(section_weights),
+                        section<F>(section_inv_mass),
+                        section<F>(section_step_values),
+                        section<F>(section_step_diagonal),
+                }
+        };
+    }
+
+private:
+    mapped_file file;
+    const mesh_cache_header *header = nullptr;
+
+    template<typename T>
+    std::span<const T> section(mesh_cache_section i) const {
+        const auto &s = header->sections[i];
+        return {reinterpret_cast<const T *>(file.data() + s.offset), s.size / sizeof(T)};
+    }
+};
+
+template<typename T>
+std::span<const char> as_chars(std::span<const T> s) {
+    return {reinterpret_cast<const char *>(s.data()), s.size_bytes()};
+}
+
+// Writes through a temporary file that is renamed into place, so a partially written cache is never picked up.
+bool write_mesh_cache(const std::string &filename, uint64_t source_hash, uint64_t settings, const mesh_view &mesh) {
+    const auto temp_filename = filename + ".tmp";
+
+    {
+        std::ofstream out(temp_filename, std::ios::binary | std::ios::trunc);
+        if (!out) return false;
+
+        mesh_cache_header h{};
+        std::memcpy(h.magic, mesh_cache_magic, sizeof(mesh_cache_magic));
+        h.version = mesh_cache_version;
+        h.scalarSize = sizeof(F);
+        h.sourceHash = source_hash;
+        h.settings = settings;
+
+        const std::span<const char> sections[section_count] = {
+                as_chars(mesh.vertices),
+                as_chars(mesh.normals),
+                as_chars(mesh.indices),
+                as_chars(mesh.op.offsets),
+                as_chars(mesh.op.columns),
+                as_chars(mesh.op.weights),
+                as_chars(mesh.op.invMass),
+                as_chars(mesh.vertexIds),
+                as_chars(mesh.op.values),
+                as_chars(mesh.op.diagonal),
+        };
+
+        auto align = [](uint64_t offset) {
+            return (offset + mesh_cache_alignment - 1) / mesh_cache_alignment * mesh_cache_alignment;
+        };
+
+        uint64_t offset = align(sizeof(mesh_cache_header));
+        for (uint32_t i = 0; i < section_count; i++) {
+            h.sections[i] = {offset, sections[i].size()};
+            offset = align(offset + sections[i].size());
+        }
+
+        out.write(reinterpret_cast<const char *>(&h), sizeof(h));
+
+        const char padding[mesh_cache_alignment] = {};
+        uint64_t position = sizeof(h);
+        for (uint32_t i = 0; i < section_count; i++) {
+            out.write(padding, h.sections[i].offset - position);
+            out.write(sections[i].data(), sections[i].size());
+            position = h.sections[i].offset + sections[i].size();
+        }
+
+        if (!out) return false;
+    }
+
+    std::error_code error;
+    std::filesystem::rename(temp_filename, filename, error);
+    return !error;
+}
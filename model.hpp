@@ -0,0 +1,87 @@
+#pragma once
+
+#include <vector>
+#include <span>
+#include <algorithm>
+#include <limits>
+#include <cstdint>
+#include <glm/glm.hpp>
+
+typedef float F;
+
+constexpr uint32_t invalid_index = std::numeric_limits<uint32_t>::max();
+
+class model {
+public:
+    std::vector<glm::vec3> vertices;
+    std::vector<glm::vec2> textureCoords;
+    std::vector<glm::vec3> normals;
+    std::vector<uint32_t> indices;
+    std::vector<uint32_t> neighborOffsets;
+    std::vector<uint32_t> neighborIndices;
+    // Load order ID of every vertex, kept pointing at the same vertex when vertices are reordered. Empty while the
+    // vertices are still in load order.
+    std::vector<uint32_t> vertexIds;
+
+    std::span<const uint32_t> neighbors(uint32_t vi) const {
+        return {neighborIndices.data() + neighborOffsets[vi], neighborIndices.data() + neighborOffsets[vi + 1]};
+    }
+
+    uint32_t vertex_id(uint32_t vi) const {
+        return vertexIds.empty() ? vi : vertexIds[vi];
+    }
+
+    uint32_t neighbor_slot(uint32_t vi, uint32_t ni) const {
+        const auto row = neighbors(vi);
+        const auto it = std::lower_bound(row.begin(), row.end(), ni);
+        if (it == row.end() || *it != ni) return invalid_index;
+        return neighborOffsets[vi] + (it - row.begin());
+    }
+};
+
+// Builds the CSR adjacency (neighborOffsets/neighborIndices) from the triangle list.
+// Each row is sorted ascending and free of duplicates.
+void build_neighbors(model &m) {
+    const auto vertex_count = m.vertices.size();
+
+    auto &offsets = m.neighborOffsets;
+    offsets.assign(vertex_count + 1, 0);
+    for (const auto &i : m.indices) {
+        offsets[i + 1] += 2;
+    }
+    for (size_t vi = 0; vi < vertex_count; vi++) {
+        offsets[vi + 1] += offsets[vi];
+    }
+
+    auto fill = std::vector<uint32_t>(offsets.begin(), offsets.end() - 1);
+    auto columns = std::vector<uint32_t>(offsets.back());
+    for (size_t f = 0; f + 2 < m.indices.size(); f += 3) {
+        const auto a = m.indices[f], b = m.indices[f + 1], c = m.indices[f + 2];
+        columns[fill[a]++] = b;
+        columns[fill[a]++] = c;
+        columns[fill[b]++] = a;
+        columns[fill[b]++] = c;
+        columns[fill[c]++] = a;
+        columns[fill[c]++] = b;
+    }
+
+    uint32_t out = 0;
+    for (size_t vi = 0; vi < vertex_count; vi++) {
+        const auto row_begin = columns.begin() + offsets[vi];
+        const auto row_end = columns.begin() + offsets[vi + 1];
+        std::sort(row_begin, row_end);
+        const auto unique_end = std::unique(row_begin, row_end);
+
+        offsets[vi] = out;
+        out = std::copy(row_begin, unique_end, columns.begin() + out) - columns.begin();
+    }
+    offsets[vertex_count] = out;
+
+    columns.resize(out);
+    columns.shrink_to_fit();
+    m.neighborIndices = std::move(columns);
+}
+
+void build_topology(model &m) {
+    build_neighbors(m);
+}
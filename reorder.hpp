@@ -0,0 +1,170 @@
+#pragma once
+
+#include <vector>
+#include <algorithm>
+#include <numeric>
+#include <cstdint>
+
+#include "model.hpp"
+
+enum class vertex_order : uint8_t {
+    // Keep the order the vertices were loaded in.
+    original,
+    // Reverse Cuthill-McKee over the adjacency, minimizes the bandwidth of the Laplacian.
+    rcm,
+    // Z-order curve over the vertex positions.
+    morton,
+};
+
+// Breadth-first level structure from start. Returns the vertices in visiting order and the number of levels, level
+// receives the depth of every visited vertex. Neighbors are visited in increasing degree, as Cuthill-McKee wants.
+std::vector<uint32_t> bfs_levels(const model &m, uint32_t start, std::vector<uint32_t> &level, uint32_t &depth) {
+    auto degree = [&](uint32_t vi) { return m.neighborOffsets[vi + 1] - m.neighborOffsets[vi]; };
+
+    std::vector<uint32_t> visit{start};
+    std::vector<uint32_t> next;
+    level[start] = 0;
+    depth = 1;
+
+    for (size_t head = 0; head < visit.size(); head++) {
+        const auto vi = visit[head];
+
+        next.clear();
+        for (const auto &ni : m.neighbors(vi)) {
+            if (level[ni] == invalid_index) {
+                level[ni] = level[vi] + 1;
+                next.push_back(ni);
+            }
+        }
+        std::sort(next.begin(), next.end(), [&](uint32_t a, uint32_t b) {
+            return degree(a) < degree(b) || (degree(a) == degree(b) && a < b);
+        });
+
+        visit.insert(visit.end(), next.begin(), next.end());
+        if (!next.empty()) depth = std::max(depth, level[vi] + 2);
+    }
+
+    return visit;
+}
+
+std::vector<uint32_t> reverse_cuthill_mckee(const model &m) {
+    const uint32_t n = m.vertices.size();
+    auto degree = [&](uint32_t vi) { return m.neighborOffsets[vi + 1] - m.neighborOffsets[vi]; };
+
+    std::vector<uint32_t> order;
+    order.reserve(n);
+    std::vector<uint32_t> level(n, invalid_index);
+
+    for (uint32_t seed = 0; seed < n; seed++) {
+        if (level[seed] != invalid_index) continue;
+
+        // Walk towards a pseudo-peripheral vertex: restart from the lowest degree vertex of the last level as long as
+        // that makes the level structure deeper.
+        uint32_t depth;
+        auto visit = bfs_levels(m, seed, level, depth);
+        for (int iteration = 0; iteration < 8; iteration++) {
+            auto candidate = visit.back();
+            for (auto it = visit.rbegin(); it != visit.rend() && level[*it] == depth - 1; ++it) {
+                if (degree(*it) < degree(candidate)) candidate = *it;
+            }
+
+            for (const auto &vi : visit) level[vi] = invalid_index;
+
+            uint32_t candidate_depth;
+            visit = bfs_levels(m, candidate, level, candidate_depth);
+            if (candidate_depth <= depth) break;
+            depth = candidate_depth;
+        }
+
+        order.insert(order.end(), visit.begin(), visit.end());
+    }
+
+    std::reverse(order.begin(), order.end());
+    return order;
+}
+
+uint64_t morton_code(uint32_t x, uint32_t y, uint32_t z) {
+    auto spread = [](uint64_t v) {
+        v &= 0x1fffff;
+        v = (v | v << 32) & 0x1f00000000ffffull;
+        v = (v | v << 16) & 0x1f0000ff0000ffull;
+        v = (v | v << 8) & 0x100f00f00f00f00full;
+        v = (v | v << 4) & 0x10c30c30c30c30c3ull;
+        v = (v | v << 2) & 0x1249249249249249ull;
+        return v;
+    };
+    return spread(x) | spread(y) << 1 | spread(z) << 2;
+}
+
+std::vector<uint32_t> morton_order(const model &m) {
+    const uint32_t n = m.vertices.size();
+    if (n == 0) return {};
+
+    auto lo = m.vertices[0], hi = m.vertices[0];
+    for (const auto &v : m.vertices) {
+        lo = glm::min(lo, v);
+        hi = glm::max(hi, v);
+    }
+    const auto scale = F(0x1fffff) / glm::max(hi - lo, glm::vec3(std::numeric_limits<F>::min()));
+
+    std::vector<std::pair<uint64_t, uint32_t>> keys(n);
+    for (uint32_t vi = 0; vi < n; vi++) {
+        const auto q = glm::uvec3((m.vertices[vi] - lo) * scale);
+        keys[vi] = {morton_code(q.x, q.y, q.z), vi};
+    }
+    std::sort(keys.begin(), keys.end());
+
+    std::vector<uint32_t> order(n);
+    for (uint32_t i = 0; i < n; i++) {
+        order[i] = keys[i].second;
+    }
+    return order;
+}
+
+// Renumbers the vertices so that new vertex i is old vertex order[i]. Attributes, triangles and vertexIds follow,
+// and the topology is rebuilt for the new numbering.
+void reorder_vertices(model &m, const std::vector<uint32_t> &order) {
+    const uint32_t n = m.vertices.size();
+
+    std::vector<uint32_t> inverse(n);
+    for (uint32_t i = 0; i < n; i++) {
+        inverse[order[i]] = i;
+    }
+
+    auto permute = [&](auto &values) {
+        if (values.size() != n) return;
+        auto old_values = values;
+        for (uint32_t i = 0; i < n; i++) {
+            values[i] = old_values[order[i]];
+        }
+    };
+
+    if (m.vertexIds.empty()) {
+        m.vertexIds.resize(n);
+        std::iota(m.vertexIds.begin(), m.vertexIds.end(), 0);
+    }
+
+    permute(m.vertices);
+    permute(m.textureCoords);
+    permute(m.normals);
+    permute(m.vertexIds);
+
+    for (auto &i : m.indices) {
+        i = inverse[i];
+    }
+
+    build_topology(m);
+}
+
+void reorder_vertices(model &m, vertex_order order) {
+    switch (order) {
+        case vertex_order::original:
+            break;
+        case vertex_order::rcm:
+            reorder_vertices(m, reverse_cuthill_mckee(m));
+            break;
+        case vertex_order::morton:
+            reorder_vertices(m, morton_order(m));
+            break;
+    }
+}
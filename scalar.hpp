@@ -0,0 +1,43 @@
+#pragma once
+
+#include <cstdint>
+#include <cstring>
+#include <glm/gtc/packing.hpp>
+
+// 16 bit storage-only scalars. They convert to and from float, arithmetic happens in whatever type they are
+// converted to, which for the simulation kernels is the accumulation type.
+
+// IEEE 754 binary16.
+struct half_float {
+    uint16_t bits = 0;
+
+    half_float() = default;
+
+    half_float(float f) : bits(glm::packHalf1x16(f)) {}
+
+    operator float() const { return glm::unpackHalf1x16(bits); }
+};
+
+// Upper half of a binary32, rounded to nearest even. Same range as float at 8 bits of precision.
+struct bfloat16 {
+    uint16_t bits = 0;
+
+    bfloat16() = default;
+
+    bfloat16(float f) {
+        uint32_t u;
+        std::memcpy(&u, &f, sizeof(u));
+        if ((u & 0x7fffffff) > 0x7f800000) {
+            bits = uint16_t(u >> 16 | 0x40);
+        } else {
+            bits = uint16_t((u + 0x7fff + (u >> 16 & 1)) >> 16);
+        }
+    }
+
+    operator float() const {
+        const uint32_t u = uint32_t(bits) << 16;
+        float f;
+        std::memcpy(&f, &u, sizeof(f));
+        return f;
+    }
+};
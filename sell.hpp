@@ -0,0 +1,231 @@
+#pragma once
+
+#include <vector>
+#include <algorithm>
+#include <numeric>
+#include <type_traits>
+#include <cstdint>
+
+#include "model.hpp"
+#include "sparse.hpp"
+#include "thread_pool.hpp"
+
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#define SELL_X86 1
+#include <immintrin.h>
+#endif
+
+// SELL-C-sigma (sliced ELLPACK) copy of a csr_view. Rows are sorted by length within windows of sigma rows and cut
+// into slices of C rows. Every slice is padded to its longest row and stored column-major, so entry j of the C rows
+// of a slice sits in C consecutive values and columns, which is one SIMD load plus one gather per entry. Padding
+// entries have a zero value and point at column 0.
+
+enum class sell_isa : uint8_t {
+    scalar,
+    avx2,
+    avx512,
+};
+
+template<typename T>
+struct basic_sell_matrix {
+    uint32_t chunk = 8;
+    sell_isa isa = sell_isa::scalar;
+    // Number of real rows, the arrays below are padded to whole slices.
+    size_t rows = 0;
+    // Sorted position to row, padded with row 0.
+    std::vector<uint32_t> permutation;
+    // Start of every slice in values and columns, plus the end.
+    std::vector<uint32_t> sliceOffsets;
+    std::vector<uint32_t> columns;
+    std::vector<T> values;
+    // Diagonal in sorted order.
+    std::vector<T> diagonal;
+
+    size_t slice_count() const { return sliceOffsets.size() - 1; }
+};
+
+typedef basic_sell_matrix<F> sell_matrix;
+
+// The SIMD kernels only exist for float operators, states and accumulation.
+template<typename T = F>
+sell_isa detect_sell_isa() {
+#ifdef SELL_X86
+    if constexpr (std::is_same_v<T, float>) {
+        __builtin_cpu_init();
+        if (__builtin_cpu_supports("avx512f")) return sell_isa::avx512;
+        if (__builtin_cpu_supports("avx2") && __builtin_cpu_supports("fma")) return sell_isa::avx2;
+    }
+#endif
+    return sell_isa::scalar;
+}
+
+template<typename T>
+basic_sell_matrix<T> build_sell(const basic_csr_view<T> &A, sell_isa isa, uint32_t sigma = 256) {
+    basic_sell_matrix<T> S;
+    S.isa = isa;
+    S.chunk = isa == sell_isa::avx512 ? 16 : 8;
+    S.rows = A.size();
+
+    const auto C = S.chunk;
+    const auto slices = (S.rows + C - 1) / C;
+    sigma = std::max(sigma, C);
+
+    auto length = [&](uint32_t row) { return A.offsets[row + 1] - A.offsets[row]; };
+
+    S.permutation.resize(slices * C, 0);
+    std::iota(S.permutation.begin(), S.permutation.begin() + S.rows, 0);
+    for (size_t window = 0; window < S.rows; window += sigma) {
+        const auto begin = S.permutation.begin() + window;
+        const auto end = S.permutation.begin() + std::min<size_t>(window + sigma, S.rows);
+        std::stable_sort(begin, end, [&](uint32_t a, uint32_t b) { return length(a) > length(b); });
+    }
+
+    S.sliceOffsets.resize(slices + 1);
+    S.sliceOffsets[0] = 0;
+    for (size_t s = 0; s < slices; s++) {
+        uint32_t width = 0;
+        for (uint32_t r = 0; r < C && s * C + r < S.rows; r++) {
+            width = std::max(width, length(S.permutation[s * C + r]));
+        }
+        S.sliceOffsets[s + 1] = S.sliceOffsets[s] + width * C;
+    }
+
+    S.columns.assign(S.sliceOffsets.back(), 0);
+    S.values.assign(S.sliceOffsets.back(), 0);
+    S.diagonal.assign(slices * C, 0);
+    for (size_t p = 0; p < S.rows; p++) {
+        const auto row = S.permutation[p];
+        const auto s = p / C, r = p % C;
+
+        S.diagonal[p] = A.diagonal[row];
+        for (auto k = A.offsets[row]; k < A.offsets[row + 1]; k++) {
+            const auto j = k - A.offsets[row];
+            S.columns[S.sliceOffsets[s] + j * C + r] = A.columns[k];
+            S.values[S.sliceOffsets[s] + j * C + r] = A.values[k];
+        }
+    }
+
+    return S;
+}
+
+template<typename T>
+basic_sell_matrix<T> build_sell(const basic_csr_view<T> &A) {
+    return build_sell(A, detect_sell_isa<T>());
+}
+
+// y = beta * x + alpha * A x over the slices [first, last), accumulated in the type of alpha. x and y must not alias.
+template<typename T, typename X, typename Y, typename A>
+void sell_kernel_scalar(const basic_sell_matrix<T> &M, const X *x, Y *y, A alpha, A beta, size_t first,
+                        size_t last) {
+    const auto C = M.chunk;
+
+    for (auto s = first; s < last; s++) {
+        const auto base = s * C;
+        const auto lanes = std::min<size_t>(C, M.rows - base);
+        const auto width = (M.sliceOffsets[s + 1] - M.sliceOffsets[s]) / C;
+
+        for (size_t r = 0; r < lanes; r++) {
+            const auto row = M.permutation[base + r];
+
+            A sum = A(M.diagonal[base + r]) * A(x[row]);
+            for (size_t j = 0; j < width; j++) {
+                const auto k = M.sliceOffsets[s] + j * C + r;
+                sum += A(M.values[k]) * A(x[M.columns[k]]);
+            }
+
+            y[row] = Y(beta * A(x[row]) + alpha * sum);
+        }
+    }
+}
+
+#ifdef SELL_X86
+
+__attribute__((target("avx2,fma")))
+void sell_kernel_avx2(const basic_sell_matrix<float> &A, const float *x, float *y, float alpha, float beta,
+                      size_t first, size_t last) {
+    const auto C = A.chunk;
+    const auto alpha_v = _mm256_set1_ps(alpha);
+    const auto beta_v = _mm256_set1_ps(beta);
+    alignas(32) float out[8];
+
+    for (auto s = first; s < last; s++) {
+        const auto width = (A.sliceOffsets[s + 1] - A.sliceOffsets[s]) / C;
+
+        for (uint32_t r = 0; r < C; r += 8) {
+            const auto base = s * C + r;
+            if (base >= A.rows) break;
+
+            const auto rows = _mm256_loadu_si256(reinterpret_cast<const __m256i *>(A.permutation.data() + base));
+            const auto x_rows = _mm256_i32gather_ps(x, rows, 4);
+            auto sum = _mm256_mul_ps(_mm256_loadu_ps(A.diagonal.data() + base), x_rows);
+
+            auto k = A.sliceOffsets[s] + r;
+            for (size_t j = 0; j < width; j++, k += C) {
+                const auto columns = _mm256_loadu_si256(reinterpret_cast<const __m256i *>(A.columns.data() + k));
+                sum = _mm256_fmadd_ps(_mm256_loadu_ps(A.values.data() + k), _mm256_i32gather_ps(x, columns, 4), sum);
+            }
+
+            _mm256_store_ps(out, _mm256_fmadd_ps(alpha_v, sum, _mm256_mul_ps(beta_v, x_rows)));
+
+            const auto lanes = std::min<size_t>(8, A.rows - base);
+            for (size_t l = 0; l < lanes; l++) {
+                y[A.permutation[base + l]] = out[l];
+            }
+        }
+    }
+}
+
+__attribute__((target("avx512f")))
+void sell_kernel_avx512(const basic_sell_matrix<float> &A, const float *x, float *y, float alpha, float beta,
+                        size_t first, size_t last) {
+    const auto C = A.chunk;
+    const auto alpha_v = _mm512_set1_ps(alpha);
+    const auto beta_v = _mm512_set1_ps(beta);
+    // Gathers take an explicit zero source, GCC warns about the undefined one of the unmasked form.
+    const auto zero = _mm512_setzero_ps();
+    const auto all = __mmask16(0xffff);
+
+    for (auto s = first; s < last; s++) {
+        const auto width = (A.sliceOffsets[s + 1] - A.sliceOffsets[s]) / C;
+
+        for (uint32_t r = 0; r < C; r += 16) {
+            const auto base = s * C + r;
+            if (base >= A.rows) break;
+
+            const auto rows = _mm512_loadu_si512(A.permutation.data() + base);
+            const auto x_rows = _mm512_mask_i32gather_ps(zero, all, rows, x, 4);
+            auto sum = _mm512_mul_ps(_mm512_loadu_ps(A.diagonal.data() + base), x_rows);
+
+            auto k = A.sliceOffsets[s] + r;
+            for (size_t j = 0; j < width; j++, k += C) {
+                const auto columns = _mm512_loadu_si512(A.columns.data() + k);
+                const auto x_columns = _mm512_mask_i32gather_ps(zero, all, columns, x, 4);
+                sum = _mm512_fmadd_ps(_mm512_loadu_ps(A.values.data() + k), x_columns, sum);
+            }
+
+            const auto lanes = std::min<size_t>(16, A.rows - base);
+            const auto mask = __mmask16((1u << lanes) - 1);
+            _mm512_mask_i32scatter_ps(y, mask, rows, _mm512_fmadd_ps(alpha_v, sum, _mm512_mul_ps(beta_v, x_rows)), 4);
+        }
+    }
+}
+
+#endif
+
+template<typename T, typename X, typename Y, typename A>
+void sell_kernel(const basic_sell_matrix<T> &M, const X *x, Y *y, A alpha, A beta, size_t first, size_t last) {
+#ifdef SELL_X86
+    if constexpr (std::is_same_v<T, float> && std::is_same_v<X, float> && std::is_same_v<Y, float> &&
+                  std::is_same_v<A, float>) {
+        switch (M.isa) {
+            case sell_isa::avx512:
+                return sell_kernel_avx512(M, x, y, alpha, beta, first, last);
+            case sell_isa::avx2:
+                return sell_kernel_avx2(M, x, y, alpha, beta, first, last);
+            case sell_isa::scalar:
+                break;
+        }
+    }
+#endif
+    sell_kernel_scalar(M, x, y, alpha, beta, first, last);
+}
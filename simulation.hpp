@@ -0,0 +1,518 @@
+#pragma once
+
+#include <vector>
+#include <algorithm>
+#include <cmath>
+#include <limits>
+#include <type_traits>
+
+#include "model.hpp"
+#include "scalar.hpp"
+#include "laplacian.hpp"
+#include "sparse.hpp"
+#include "thread_pool.hpp"
+#include "sell.hpp"
+#include "temporal_blocking.hpp"
+#include "valence.hpp"
+#include "solver.hpp"
+#include "cholesky.hpp"
+#include "stability.hpp"
+
+// The simulation is templated on three scalar types: S stores the per-vertex state, T stores the operator and the
+// step accumulates in the type of dt. float/float/float is the default, float/float/double gives fp32 storage with
+// fp64 accumulation, double throughout is for validation runs, and half_float or bfloat16 state storage halves the
+// state traffic on huge meshes.
+
+// Per-vertex simulation fields. u is double buffered: a step reads u() and writes next_u(), then swap() flips the
+// roles, so steady-state stepping neither allocates nor copies. The velocity v() is only allocated for the wave
+// equation, which updates it in place.
+template<typename S>
+class basic_simulation_state {
+public:
+    explicit basic_simulation_state(size_t n, bool velocity = false)
+            : us{std::vector<S>(n), std::vector<S>(n)}, vs(velocity ? n : 0) {}
+
+    std::vector<S> &u() { return us[current]; }
+
+    const std::vector<S> &u() const { return us[current]; }
+
+    std::vector<S> &next_u() { return us[current ^ 1]; }
+
+    std::vector<S> &v() { return vs; }
+
+    void swap() { current ^= 1; }
+
+    size_t size() const { return us[0].size(); }
+
+private:
+    std::vector<S> us[2];
+    std::vector<S> vs;
+    uint32_t current = 0;
+};
+
+typedef basic_simulation_state<F> simulation_state;
+
+// fields independent scalar fields advanced together, stored interleaved per vertex: field f of vertex vi is
+// u()[vi * fields() + f]. One pass over the operator updates all of them, so every weight and column index is loaded
+// once per step instead of once per field.
+template<typename S>
+class basic_simulation_batch {
+public:
+    basic_simulation_batch(size_t n, uint32_t fields)
+            : us{std::vector<S>(n * fields), std::vector<S>(n * fields)}, n(n), fieldCount(fields) {}
+
+    std::vector<S> &u() { return us[current]; }
+
+    const std::vector<S> &u() const { return us[current]; }
+
+    std::vector<S> &next_u() { return us[current ^ 1]; }
+
+    void swap() { current ^= 1; }
+
+    size_t size() const { return n; }
+
+    uint32_t fields() const { return fieldCount; }
+
+private:
+    std::vector<S> us[2];
+    size_t n;
+    uint32_t fieldCount;
+    uint32_t current = 0;
+};
+
+typedef basic_simulation_batch<F> simulation_batch;
+
+template<typename S, typename T, typename A>
+void update_simulation_worker(const std::vector<S> &old_us, std::vector<S> &us,
+                              const uint32_t start, const uint32_t end,
+                              const A &dt, const basic_csr_view<T> &M) {
+    for (uint32_t vi = start; vi < end; vi++) {
+        const auto old_u = A(old_us[vi]);
+
+        const auto L = M.template row_dot<A>(old_us.data(), vi);
+        us[vi] = S(old_u + L * dt);
+    }
+}
+
+template<typename S, typename T, typename A>
+void update_simulation(basic_simulation_state<S> &state, const A &dt, const basic_laplacian<T> &op,
+                       thread_pool &pool) {
+    const auto &old_us = state.u();
+    auto &us = state.next_u();
+
+    const auto M = op.matrix();
+    pool.parallel_for(op.size(), [&](uint32_t start, uint32_t end) {
+        update_simulation_worker(old_us, us, start, end, dt, M);
+    });
+
+    state.swap();
+}
+
+// Leapfrog for the wave equation u'' = L u, kick and drift fused into one pass: v += dt L u, then u += dt v with the
+// new v. v is only read and written by its own row, so it is updated in place, u stays double buffered because rows
+// read their neighbors' old u. v lives at the half steps. The scheme is symplectic, the energy oscillates instead of
+// drifting, and stable for dt < 2 / sqrt(rho(L)), see time_step_estimate::wave_dt.
+template<typename S, typename T, typename A>
+void update_wave_worker(const std::vector<S> &old_us, std::vector<S> &us, std::vector<S> &vs,
+                        const uint32_t start, const uint32_t end,
+                        const A &dt, const basic_csr_view<T> &M) {
+    for (uint32_t vi = start; vi < end; vi++) {
+        const auto L = M.template row_dot<A>(old_us.data(), vi);
+        const auto v = A(vs[vi]) + L * dt;
+        vs[vi] = S(v);
+        us[vi] = S(A(old_us[vi]) + v * dt);
+    }
+}
+
+// One leapfrog step, the state needs its velocity.
+template<typename S, typename T, typename A>
+void update_wave(basic_simulation_state<S> &state, const A &dt, const basic_laplacian<T> &op, thread_pool &pool) {
+    const auto &old_us = state.u();
+    auto &us = state.next_u();
+    auto &vs = state.v();
+
+    const auto M = op.matrix();
+    pool.parallel_for(op.size(), [&](uint32_t start, uint32_t end) {
+        update_wave_worker(old_us, us, vs, start, end, dt, M);
+    });
+
+    state.swap();
+}
+
+// Steps the fields [f, f + W) of row vi. W is a compile time width so the field loops are fixed length and
+// vectorize, the row's weights are reused from L1 across the tiles of one row.
+template<uint32_t W, typename S, typename T, typename A>
+void update_simulation_batch_tile(const S *old_us, S *us, const uint32_t fields, const uint32_t f, const uint32_t vi,
+                                  const A &dt, const basic_csr_view<T> &M) {
+    const S *old_u = old_us + size_t(vi) * fields + f;
+
+    const auto diagonal = A(M.diagonal[vi]);
+    A acc[W];
+    for (uint32_t j = 0; j < W; j++) {
+        acc[j] = diagonal * A(old_u[j]);
+    }
+
+    for (auto k = M.offsets[vi]; k < M.offsets[vi + 1]; k++) {
+        const auto w = A(M.values[k]);
+        const S *neighbor_u = old_us + size_t(M.columns[k]) * fields + f;
+        for (uint32_t j = 0; j < W; j++) {
+            acc[j] += w * A(neighbor_u[j]);
+        }
+    }
+
+    S *u = us + size_t(vi) * fields + f;
+    for (uint32_t j = 0; j < W; j++) {
+        u[j] = S(A(old_u[j]) + acc[j] * dt);
+    }
+}
+
+template<typename S, typename T, typename A>
+void update_simulation_batch_worker(const std::vector<S> &old_us, std::vector<S> &us, const uint32_t fields,
+                                    const uint32_t start, const uint32_t end,
+                                    const A &dt, const basic_csr_view<T> &M) {
+    const auto x = old_us.data();
+    const auto y = us.data();
+
+    for (uint32_t vi = start; vi < end; vi++) {
+        uint32_t f = 0;
+        for (; f + 8 <= fields; f += 8) {
+            update_simulation_batch_tile<8>(x, y, fields, f, vi, dt, M);
+        }
+        if (f + 4 <= fields) {
+            update_simulation_batch_tile<4>(x, y, fields, f, vi, dt, M);
+            f += 4;
+        }
+        if (f + 2 <= fields) {
+            update_simulation_batch_tile<2>(x, y, fields, f, vi, dt, M);
+            f += 2;
+        }
+        if (f < fields) {
+            update_simulation_batch_tile<1>(x, y, fields, f, vi, dt, M);
+        }
+    }
+}
+
+// Explicit step of every field of the batch in one pass over the operator.
+template<typename S, typename T, typename A>
+void update_simulation(basic_simulation_batch<S> &batch, const A &dt, const basic_laplacian<T> &op,
+                       thread_pool &pool) {
+    const auto &old_us = batch.u();
+    auto &us = batch.next_u();
+
+    const auto M = op.matrix();
+    pool.parallel_for(op.size(), [&](uint32_t start, uint32_t end) {
+        update_simulation_batch_worker(old_us, us, batch.fields(), start, end, dt, M);
+    });
+
+    batch.swap();
+}
+
+// Same explicit step on the SELL-C-sigma copy of the operator, using the SIMD kernel picked when it was built.
+template<typename S, typename T, typename A>
+void update_simulation(basic_simulation_state<S> &state, const A &dt, const basic_sell_matrix<T> &M,
+                       thread_pool &pool) {
+    const auto old_us = state.u().data();
+    const auto us = state.next_u().data();
+
+    pool.parallel_for(M.slice_count(), [&](size_t start, size_t end) {
+        sell_kernel(M, old_us, us, dt, A(1), start, end);
+    });
+
+    state.swap();
+}
+
+// Same explicit step on the valence-sorted copy of the operator.
+template<typename S, typename T, typename A>
+void update_simulation(basic_simulation_state<S> &state, const A &dt, const basic_valence_matrix<T> &M,
+                       thread_pool &pool) {
+    const auto old_us = state.u().data();
+    const auto us = state.next_u().data();
+
+    pool.parallel_for(M.size(), [&](size_t start, size_t end) {
+        valence_kernel(M, old_us, us, dt, A(1), start, end);
+    });
+
+    state.swap();
+}
+
+// Advances blocking.depth explicit steps at once, patch by patch.
+template<typename S, typename T, typename A>
+void update_simulation(basic_simulation_state<S> &state, const A &dt, const basic_temporal_blocking<T> &blocking,
+                       thread_pool &pool) {
+    const auto &old_us = state.u();
+    auto &us = state.next_u();
+
+    pool.parallel_for(blocking.patches.size(), [&](size_t start, size_t end) {
+        temporal_blocking_worker(blocking, old_us, us, dt, start, end);
+    });
+
+    state.swap();
+}
+
+// Explicit stepping that survives a dt above the stability limit. Every step also returns the largest magnitude it
+// wrote, one max per row on top of the stencil. Stable steps of the heat equation keep the state within a small
+// margin of its magnitude at the last checkpoint, unstable ones grow it exponentially, so a step that exceeds twice
+// that magnitude, or is not finite, restores the checkpoint and shrinks dt.
+template<typename S, typename A>
+struct basic_adaptive_step {
+    A dt = 0;
+    A shrink = A(0.5);
+    // Steps between checkpoints.
+    uint32_t interval = 64;
+    uint32_t rollbacks = 0;
+    uint32_t steps = 0;
+    std::vector<S> checkpoint;
+    A checkpointPeak = 0;
+};
+
+typedef basic_adaptive_step<F, F> adaptive_step;
+
+// update_simulation_worker without the velocity, returning the largest magnitude written. NaN is counted as
+// infinity, since it would drop out of the max.
+template<typename S, typename T, typename A>
+A update_simulation_checked_worker(const std::vector<S> &old_us, std::vector<S> &us,
+                                   const uint32_t start, const uint32_t end,
+                                   const A &dt, const basic_csr_view<T> &M) {
+    A peak = 0;
+    for (uint32_t vi = start; vi < end; vi++) {
+        const auto L = M.template row_dot<A>(old_us.data(), vi);
+        const auto u = S(A(old_us[vi]) + L * dt);
+        us[vi] = u;
+
+        const auto magnitude = std::abs(A(u));
+        if (!(magnitude <= peak)) {
+            peak = magnitude == magnitude ? magnitude : std::numeric_limits<A>::infinity();
+        }
+    }
+    return peak;
+}
+
+template<typename S, typename T, typename A>
+void update_simulation(basic_simulation_state<S> &state, basic_adaptive_step<S, A> &step, const basic_laplacian<T> &op,
+                       thread_pool &pool) {
+    const auto &old_us = state.u();
+    auto &us = state.next_u();
+
+    if (step.checkpoint.empty()) {
+        step.checkpoint = old_us;
+        step.checkpointPeak = 0;
+        for (const auto &u : old_us) {
+            step.checkpointPeak = std::max(step.checkpointPeak, std::abs(A(u)));
+        }
+    }
+
+    const auto M = op.matrix();
+    const auto peak = pool.parallel_reduce(op.size(), A(0), [&](size_t start, size_t end) {
+        return update_simulation_checked_worker(old_us, us, start, end, step.dt, M);
+    }, [](const A &a, const A &b) { return std::max(a, b); });
+
+    if (peak > 2 * step.checkpointPeak) {
+        std::copy(step.checkpoint.begin(), step.checkpoint.end(), state.u().begin());
+        step.dt *= step.shrink;
+        step.rollbacks++;
+        step.steps = 0;
+        return;
+    }
+
+    state.swap();
+    if (++step.steps == step.interval) {
+        std::copy(state.u().begin(), state.u().end(), step.checkpoint.begin());
+        // The bound never grows, or a slowly growing instability would raise it checkpoint by checkpoint.
+        step.checkpointPeak = std::min(step.checkpointPeak, peak);
+        step.steps = 0;
+    }
+}
+
+// Second order Runge-Kutta-Legendre super-time-stepping (Meyer, Balsara and Aslam 2014). A step of dt is made of s
+// stages, each one evaluation of the operator like an explicit Euler step, and stays stable up to (s^2 + s - 2) / 4
+// times the explicit limit. Large steps cost O(sqrt(dt)) operator passes and no linear solve, and every stage is
+// parallel over the rows like update_simulation_worker.
+template<typename A>
+struct basic_rkl2_step {
+    A dt = 0;
+    uint32_t stages = 2;
+    // L u at the start of the step, and rotating storage for the two previous stages and the one being written.
+    std::vector<A> l0;
+    std::vector<A> y[3];
+};
+
+typedef basic_rkl2_step<F> rkl2_step;
+
+// Fewest stages that make dt stable, given the explicit Euler limit.
+template<typename A>
+basic_rkl2_step<A> build_rkl2_step(size_t n, A dt, double explicit_dt) {
+    basic_rkl2_step<A> step;
+    step.dt = dt;
+
+    // Smallest s with s^2 + s - 2 >= 4 dt / explicit_dt.
+    const auto ratio = double(dt) / explicit_dt;
+    step.stages = std::max(2u, uint32_t(std::ceil((std::sqrt(9 + 16 * ratio) - 1) / 2)));
+
+    step.l0.resize(n);
+    for (auto &y : step.y) y.resize(n);
+    return step;
+}
+
+// One step of step.dt. Stage j is
+//   Y_j = mu_j Y_j-1 + nu_j Y_j-2 + (1 - mu_j - nu_j) Y_0 + mu~_j dt L Y_j-1 + gamma~_j dt L Y_0,
+// with Y_0 = u, Y_1 = Y_0 + mu~_1 dt L Y_0 and the new u = Y_s.
+template<typename S, typename T, typename A>
+void update_simulation(basic_simulation_state<S> &state, basic_rkl2_step<A> &step, const basic_laplacian<T> &op,
+                       thread_pool &pool) {
+    const auto y0 = state.u().data();
+    const auto l0 = step.l0.data();
+    const auto s = step.stages;
+    const auto M = op.matrix();
+
+    auto b = [](uint32_t j) { return j < 2 ? A(1) / 3 : A(j * j + j - 2) / A(2 * j * (j + 1)); };
+    const auto w1 = A(4) / A(s * s + s - 2);
+
+    const auto mu1 = b(1) * w1 * step.dt;
+    const auto y1 = step.y[1].data();
+    pool.parallel_for(op.size(), [&](uint32_t start, uint32_t end) {
+        for (uint32_t vi = start; vi < end; vi++) {
+            l0[vi] = M.template row_dot<A>(y0, vi);
+            y1[vi] = A(y0[vi]) + mu1 * l0[vi];
+        }
+    });
+
+    for (uint32_t j = 2; j <= s; j++) {
+        const auto mu = A(2 * j - 1) / A(j) * b(j) / b(j - 1);
+        const auto nu = -A(j - 1) / A(j) * b(j) / b(j - 2);
+        const auto mu_dt = mu * w1 * step.dt;
+        const auto gamma_dt = -(1 - b(j - 1)) * mu_dt;
+
+        // Y_0 is the state itself, so at j = 2 the Y_j-2 term folds into the Y_0 one.
+        const auto y_1 = step.y[(j - 1) % 3].data();
+        const auto y_2 = j == 2 ? nullptr : step.y[(j - 2) % 3].data();
+        const auto c0 = j == 2 ? 1 - mu : 1 - mu - nu;
+
+        auto stage = [&](auto *y) {
+            typedef std::remove_pointer_t<decltype(y)> Y;
+            pool.parallel_for(op.size(), [&](uint32_t start, uint32_t end) {
+                for (uint32_t vi = start; vi < end; vi++) {
+                    const auto L = M.template row_dot<A>(y_1, vi);
+                    A sum = mu * y_1[vi] + c0 * A(y0[vi]) + mu_dt * L + gamma_dt * l0[vi];
+                    if (y_2) sum += nu * y_2[vi];
+                    y[vi] = Y(sum);
+                }
+            });
+        };
+
+        if (j == s) {
+            stage(state.next_u().data());
+        } else {
+            stage(step.y[j % 3].data());
+        }
+    }
+
+    state.swap();
+}
+
+enum class implicit_solver : uint8_t {
+    // Preconditioned conjugate gradient, warm started from the current state.
+    cg,
+    // Sparse LDL^T factored once, every step is a pair of triangular solves.
+    ldlt,
+    // Smoothed aggregation multigrid V-cycles, warm started from the current state.
+    amg,
+};
+
+struct implicit_options {
+    implicit_solver solver = implicit_solver::cg;
+    preconditioner_type preconditioner = preconditioner_type::jacobi;
+    cg_options cg;
+};
+
+// Backward Euler: (M - dt L) u' = M u. Unconditionally stable, so dt can be orders of magnitude above the explicit
+// limit. The system, and its preconditioner or factorization, are built for one dt.
+template<typename T>
+struct basic_implicit_step {
+    T dt = 0;
+    implicit_options options;
+    basic_system_matrix<T> system;
+    basic_preconditioner<T> preconditioner;
+    basic_ldlt<T> factorization;
+    basic_amg<T> multigrid;
+    std::vector<T> mass;
+    // Result of the latest iterative solve.
+    cg_result result;
+
+    std::vector<T> rhs;
+    std::vector<T> x;
+    basic_cg_workspace<T> workspace;
+};
+
+typedef basic_implicit_step<F> implicit_step;
+
+template<typename T, typename U>
+basic_implicit_step<T> build_implicit_step(const basic_laplacian<U> &op, T dt, thread_pool &pool,
+                                           const implicit_options &options = {}) {
+    basic_implicit_step<T> step;
+    step.dt = dt;
+    step.options = options;
+    step.system = build_system_matrix(op, T(1), dt, pool);
+
+    // A vanishing pivot leaves the factorization unusable, the step then falls back to CG, which step.options.solver
+    // reports.
+    if (options.solver == implicit_solver::ldlt && !step.factorization.factor(step.system.view())) {
+        step.options.solver = implicit_solver::cg;
+    }
+
+    switch (step.options.solver) {
+        case implicit_solver::cg:
+            step.preconditioner = build_preconditioner(step.system.view(), options.preconditioner, pool);
+            break;
+        case implicit_solver::ldlt:
+            break;
+        case implicit_solver::amg:
+            step.multigrid.build(step.system.view(), pool);
+            break;
+    }
+
+    step.mass.resize(op.size());
+    for (size_t vi = 0; vi < op.size(); vi++) {
+        step.mass[vi] = 1 / T(op.invMass[vi]);
+    }
+
+    return step;
+}
+
+// One backward Euler step of step.dt.
+template<typename S, typename T>
+void update_simulation(basic_simulation_state<S> &state, basic_implicit_step<T> &step, thread_pool &pool) {
+    const auto &old_us = state.u();
+    auto &us = state.next_u();
+    const auto n = state.size();
+
+    step.rhs.resize(n);
+    step.x.resize(n);
+    pool.parallel_for(n, [&](size_t start, size_t end) {
+        for (auto vi = start; vi < end; vi++) {
+            step.rhs[vi] = step.mass[vi] * T(old_us[vi]);
+            step.x[vi] = T(old_us[vi]);
+        }
+    });
+
+    switch (step.options.solver) {
+        case implicit_solver::cg:
+            step.result = solve_cg(step.system.view(), step.preconditioner, step.rhs.data(), step.x.data(),
+                                   step.workspace, pool, step.options.cg);
+            break;
+        case implicit_solver::ldlt:
+            step.factorization.solve(step.rhs.data(), step.x.data(), pool);
+            break;
+        case implicit_solver::amg:
+            step.result = solve_multigrid(step.system.view(), step.multigrid, step.rhs.data(), step.x.data(), pool,
+                                          step.options.cg);
+            break;
+    }
+
+    pool.parallel_for(n, [&](size_t start, size_t end) {
+        for (auto vi = start; vi < end; vi++) {
+            us[vi] = S(step.x[vi]);
+        }
+    });
+
+    state.swap();
+}
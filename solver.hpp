@@ -0,0 +1,337 @@
+#pragma once
+
+#include <vector>
+#include <span>
+#include <cmath>
+#include <algorithm>
+#include <cstdint>
+
+#include "model.hpp"
+#include "sparse.hpp"
+#include "laplacian.hpp"
+#include "thread_pool.hpp"
+#include "amg.hpp"
+
+// Iterative solver for the symmetric positive definite systems built from the cotangent operator. With the Laplacian
+// L (L_ij = weights, L_ii = -sum of the row's weights) and the lumped mass M = invMass^-1, the systems all have the
+// form (a M - b L) x = rhs, which for a, b > 0 is an M-matrix when the weights are positive.
+
+// Owned values of a matrix that shares the off-diagonal pattern of a Laplacian.
+template<typename T>
+struct basic_system_matrix {
+    std::span<const uint32_t> offsets;
+    std::span<const uint32_t> columns;
+    std::vector<T> values;
+    std::vector<T> diagonal;
+
+    size_t size() const { return diagonal.size(); }
+
+    basic_csr_view<T> view() const { return {offsets, columns, values, diagonal}; }
+};
+
+// a M - b L.
+template<typename T, typename U>
+basic_system_matrix<T> build_system_matrix(const basic_laplacian<U> &op, T a, T b, thread_pool &pool) {
+    basic_system_matrix<T> S{op.offsets, op.columns, std::vector<T>(op.columns.size()), std::vector<T>(op.size())};
+
+    pool.parallel_for(op.size(), [&](size_t start, size_t end) {
+        for (auto vi = start; vi < end; vi++) {
+            T sum = 0;
+            for (auto k = op.offsets[vi]; k < op.offsets[vi + 1]; k++) {
+                S.values[k] = -b * T(op.weights[k]);
+                sum += T(op.weights[k]);
+            }
+            S.diagonal[vi] = a / T(op.invMass[vi]) + b * sum;
+        }
+    });
+
+    return S;
+}
+
+enum class preconditioner_type : uint8_t {
+    // Inverse diagonal, applied in parallel.
+    jacobi,
+    // Zero fill incomplete Cholesky. Far fewer iterations than Jacobi, but its triangular solves run serially.
+    ic0,
+    // One smoothed aggregation V-cycle. Iteration counts that do not grow with the mesh size.
+    amg,
+};
+
+template<typename T>
+struct basic_preconditioner {
+    preconditioner_type type = preconditioner_type::jacobi;
+    // Jacobi.
+    std::vector<T> invDiagonal;
+    // IC(0): rows of the lower triangular factor with the strictly lower entries apart from the diagonal.
+    std::vector<uint32_t> lowerOffsets;
+    std::vector<uint32_t> lowerColumns;
+    std::vector<T> lowerValues;
+    std::vector<T> lowerDiagonal;
+    basic_amg<T> multigrid;
+
+    size_t size() const {
+        switch (type) {
+            case preconditioner_type::jacobi:
+                return invDiagonal.size();
+            case preconditioner_type::ic0:
+                return lowerDiagonal.size();
+            case preconditioner_type::amg:
+                return multigrid.level_count() == 0 ? 0 : multigrid.level_size(0);
+        }
+        return 0;
+    }
+
+    // z = P^-1 r.
+    void apply(const T *r, T *z, thread_pool &pool) {
+        const auto n = size();
+
+        switch (type) {
+            case preconditioner_type::jacobi:
+                pool.parallel_for(n, [&](size_t start, size_t end) {
+                    for (auto i = start; i < end; i++) {
+                        z[i] = invDiagonal[i] * r[i];
+                    }
+                });
+                break;
+            case preconditioner_type::ic0:
+                // L y = r row by row, then L^T z = y column by column, both in place.
+                for (size_t i = 0; i < n; i++) {
+                    T sum = r[i];
+                    for (auto k = lowerOffsets[i]; k < lowerOffsets[i + 1]; k++) {
+                        sum -= lowerValues[k] * z[lowerColumns[k]];
+                    }
+                    z[i] = sum / lowerDiagonal[i];
+                }
+                for (size_t i = n; i-- > 0;) {
+                    z[i] /= lowerDiagonal[i];
+                    for (auto k = lowerOffsets[i]; k < lowerOffsets[i + 1]; k++) {
+                        z[lowerColumns[k]] -= lowerValues[k] * z[i];
+                    }
+                }
+                break;
+            case preconditioner_type::amg:
+                pool.parallel_for(n, [&](size_t start, size_t end) { std::fill(z + start, z + end, T(0)); });
+                multigrid.vcycle(r, z, pool);
+                break;
+        }
+    }
+};
+
+// Row oriented IC(0): L_ij = (a_ij - sum_{m<j} L_im L_jm) / L_jj over the pattern of the lower triangle of A. A pivot
+// that breaks down, which only happens with negative weights from obtuse triangles, falls back to the diagonal of A.
+template<typename T>
+void factor_ic0(const basic_csr_view<T> &A, basic_preconditioner<T> &P) {
+    const auto n = A.size();
+
+    P.lowerOffsets.assign(1, 0);
+    P.lowerColumns.clear();
+    P.lowerValues.clear();
+    P.lowerDiagonal.resize(n);
+
+    for (uint32_t i = 0; i < n; i++) {
+        const auto row = P.lowerColumns.size();
+
+        for (auto k = A.offsets[i]; k < A.offsets[i + 1] && A.columns[k] < i; k++) {
+            const auto j = A.columns[k];
+
+            // Sparse dot of the finished part of row i with row j, both sorted by column.
+            T sum = A.values[k];
+            auto a = row, b = size_t(P.lowerOffsets[j]);
+            while (a < P.lowerColumns.size() && b < P.lowerOffsets[j + 1]) {
+                if (P.lowerColumns[a] < P.lowerColumns[b]) a++;
+                else if (P.lowerColumns[a] > P.lowerColumns[b]) b++;
+                else sum -= P.lowerValues[a++] * P.lowerValues[b++];
+            }
+
+            P.lowerColumns.push_back(j);
+            P.lowerValues.push_back(sum / P.lowerDiagonal[j]);
+        }
+
+        T pivot = A.diagonal[i];
+        for (auto k = row; k < P.lowerColumns.size(); k++) {
+            pivot -= P.lowerValues[k] * P.lowerValues[k];
+        }
+        P.lowerDiagonal[i] = std::sqrt(pivot > 0 ? pivot : A.diagonal[i]);
+        P.lowerOffsets.push_back(P.lowerColumns.size());
+    }
+}
+
+template<typename T>
+basic_preconditioner<T> build_preconditioner(const basic_csr_view<T> &A, preconditioner_type type, thread_pool &pool) {
+    basic_preconditioner<T> P;
+    P.type = type;
+
+    switch (type) {
+        case preconditioner_type::jacobi:
+            P.invDiagonal.resize(A.size());
+            for (size_t i = 0; i < A.size(); i++) {
+                P.invDiagonal[i] = 1 / A.diagonal[i];
+            }
+            break;
+        case preconditioner_type::ic0:
+            factor_ic0(A, P);
+            break;
+        case preconditioner_type::amg:
+            P.multigrid.build(A, pool);
+            break;
+    }
+
+    return P;
+}
+
+struct cg_options {
+    // Relative to the norm of the right hand side.
+    double tolerance = 1e-6;
+    uint32_t maxIterations = 1000;
+};
+
+struct cg_result {
+    uint32_t iterations = 0;
+    // Final relative residual.
+    double residual = 0;
+};
+
+// Work vectors of one solve, kept between solves so repeated solves do not allocate.
+template<typename T>
+struct basic_cg_workspace {
+    std::vector<T> r, z, p, q;
+
+    void resize(size_t n) {
+        r.resize(n);
+        z.resize(n);
+        p.resize(n);
+        q.resize(n);
+    }
+};
+
+// Preconditioned conjugate gradient on A x = b, starting from the x passed in. Dot products are accumulated in double.
+template<typename T>
+cg_result solve_cg(const basic_csr_view<T> &A, basic_preconditioner<T> &P, const T *b, T *x,
+                   basic_cg_workspace<T> &w, thread_pool &pool, const cg_options &options = {}) {
+    const auto n = A.size();
+    w.resize(n);
+    const auto r = w.r.data(), z = w.z.data(), p = w.p.data(), q = w.q.data();
+
+    auto dot = [&](const T *u, const T *v) {
+        return pool.parallel_sum<double>(n, [&](size_t start, size_t end) {
+            double sum = 0;
+            for (auto i = start; i < end; i++) {
+                sum += double(u[i]) * double(v[i]);
+            }
+            return sum;
+        });
+    };
+
+    const auto b_norm = std::sqrt(dot(b, b));
+    if (b_norm == 0) {
+        pool.parallel_for(n, [&](size_t start, size_t end) { std::fill(x + start, x + end, T(0)); });
+        return {};
+    }
+
+    auto r_norm = std::sqrt(pool.parallel_sum<double>(n, [&](size_t start, size_t end) {
+        double sum = 0;
+        for (auto i = start; i < end; i++) {
+            r[i] = b[i] - A.row_dot(x, i);
+            sum += double(r[i]) * double(r[i]);
+        }
+        return sum;
+    }));
+
+    cg_result result;
+    if (r_norm <= options.tolerance * b_norm) {
+        result.residual = r_norm / b_norm;
+        return result;
+    }
+
+    P.apply(r, z, pool);
+    pool.parallel_for(n, [&](size_t start, size_t end) { std::copy(z + start, z + end, p + start); });
+    auto rz = dot(r, z);
+
+    while (result.iterations < options.maxIterations) {
+        result.iterations++;
+
+        const auto pq = pool.parallel_sum<double>(n, [&](size_t start, size_t end) {
+            double sum = 0;
+            for (auto i = start; i < end; i++) {
+                q[i] = A.row_dot(p, i);
+                sum += double(p[i]) * double(q[i]);
+            }
+            return sum;
+        });
+
+        const auto alpha = T(rz / pq);
+        r_norm = std::sqrt(pool.parallel_sum<double>(n, [&](size_t start, size_t end) {
+            double sum = 0;
+            for (auto i = start; i < end; i++) {
+                x[i] += alpha * p[i];
+                r[i] -= alpha * q[i];
+                sum += double(r[i]) * double(r[i]);
+            }
+            return sum;
+        }));
+
+        if (r_norm <= options.tolerance * b_norm) break;
+
+        P.apply(r, z, pool);
+        const auto rz_next = dot(r, z);
+        const auto beta = T(rz_next / rz);
+        rz = rz_next;
+
+        pool.parallel_for(n, [&](size_t start, size_t end) {
+            for (auto i = start; i < end; i++) {
+                p[i] = z[i] + beta * p[i];
+            }
+        });
+    }
+
+    result.residual = r_norm / b_norm;
+    return result;
+}
+
+// Multigrid used as the solver: V-cycles on A x = b from the x passed in, until the relative residual drops below the
+// tolerance or stops improving.
+template<typename T>
+cg_result solve_multigrid(const basic_csr_view<T> &A, basic_amg<T> &multigrid, const T *b, T *x, thread_pool &pool,
+                          const cg_options &options = {}) {
+    const auto n = A.size();
+
+    auto residual_norm = [&]() {
+        return std::sqrt(pool.parallel_sum<double>(n, [&](size_t start, size_t end) {
+            double sum = 0;
+            for (auto i = start; i < end; i++) {
+                const auto r = double(b[i]) - A.template row_dot<double>(x, i);
+                sum += r * r;
+            }
+            return sum;
+        }));
+    };
+
+    const auto b_norm = std::sqrt(pool.parallel_sum<double>(n, [&](size_t start, size_t end) {
+        double sum = 0;
+        for (auto i = start; i < end; i++) sum += double(b[i]) * double(b[i]);
+        return sum;
+    }));
+    if (b_norm == 0) {
+        pool.parallel_for(n, [&](size_t start, size_t end) { std::fill(x + start, x + end, T(0)); });
+        return {};
+    }
+
+    cg_result result;
+    auto r_norm = residual_norm();
+    uint32_t stalled = 0;
+    while (r_norm > options.tolerance * b_norm && result.iterations < options.maxIterations) {
+        multigrid.vcycle(b, x, pool);
+        result.iterations++;
+
+        // Cycles that keep failing to reduce the residual have hit the rounding floor of T, which for the stiff systems
+        // of large dt on fine meshes lies well above the tolerance in single precision. A single such cycle can also
+        // happen early on, when the residual norm grows while the error norm drops.
+        const auto previous = r_norm;
+        r_norm = residual_norm();
+        stalled = r_norm > 0.9 * previous ? stalled + 1 : 0;
+        if (stalled == 2) break;
+    }
+
+    result.residual = r_norm / b_norm;
+    return result;
+}
@@ -0,0 +1,40 @@
+#pragma once
+
+#include <span>
+#include <vector>
+#include <cstdint>
+
+#include "model.hpp"
+
+// Non-owning square CSR matrix with the diagonal kept apart from the off-diagonal entries. Mesh operators all share
+// the off-diagonal pattern of the vertex adjacency, so offsets and columns usually point at the model's (or the
+// mapped cache's) neighborOffsets and neighborIndices.
+template<typename T>
+struct basic_csr_view {
+    std::span<const uint32_t> offsets;
+    std::span<const uint32_t> columns;
+    std::span<const T> values;
+    std::span<const T> diagonal;
+
+    size_t size() const { return diagonal.size(); }
+
+    // Row i times x, accumulated in A whatever types the matrix and x are stored in.
+    template<typename A = T, typename X>
+    A row_dot(const X *x, size_t i) const {
+        A sum = A(diagonal[i]) * A(x[i]);
+        for (auto k = offsets[i]; k < offsets[i + 1]; k++) {
+            sum += A(values[k]) * A(x[columns[k]]);
+        }
+        return sum;
+    }
+};
+
+typedef basic_csr_view<F> csr_view;
+
+// y = A x over the rows [start, end).
+template<typename T, typename X, typename Y>
+void spmv(const basic_csr_view<T> &A, const X *x, Y *y, size_t start, size_t end) {
+    for (auto i = start; i < end; i++) {
+        y[i] = Y(A.row_dot(x, i));
+    }
+}
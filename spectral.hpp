@@ -0,0 +1,414 @@
+#pragma once
+
+#include <string>
+#include <vector>
+#include <span>
+#include <fstream>
+#include <filesystem>
+#include <algorithm>
+#include <numeric>
+#include <cmath>
+#include <cstring>
+#include <cstdint>
+
+#include "model.hpp"
+#include "laplacian.hpp"
+#include "thread_pool.hpp"
+#include "solver.hpp"
+#include "cholesky.hpp"
+#include "mapped_file.hpp"
+#include "mesh_cache.hpp"
+
+// Lowest eigenpairs of the cotangent operator, K phi = lambda M phi with the stiffness matrix K = -L and the lumped
+// mass M, and heat evolution in that basis. The eigenvectors are M-orthonormal, so
+//   u(t) = sum_i e^(-lambda_i t) <phi_i, u(0)>_M phi_i
+// evaluates any t in O(count n) without stepping. Only the first count modes are kept, which low-pass filters u(0):
+// sharp initial data rings until the higher modes it misses would have decayed anyway.
+
+// Eigenvalues and eigenvectors of a symmetric tridiagonal matrix by the implicit QL method. d holds the diagonal, e the
+// off-diagonal with e[i] coupling i and i + 1. On return d holds the eigenvalues, unsorted, and column i of the
+// row-major m x m matrix z the eigenvector of d[i]. Returns false if an eigenvalue does not converge.
+bool tridiagonal_eigen(std::vector<double> &d, std::vector<double> &e, std::vector<double> &z) {
+    const int m = int(d.size());
+    e.resize(m);
+    e[m - 1] = 0;
+    z.assign(size_t(m) * m, 0);
+    for (int i = 0; i < m; i++) z[size_t(i) * m + i] = 1;
+
+    for (int l = 0; l < m; l++) {
+        int iterations = 0;
+        int k;
+        do {
+            // Split off a block at the first negligible off-diagonal.
+            for (k = l; k < m - 1; k++) {
+                const auto dd = std::abs(d[k]) + std::abs(d[k + 1]);
+                if (std::abs(e[k]) <= 1e-16 * dd) break;
+            }
+            if (k == l) break;
+            if (iterations++ == 64) return false;
+
+            // Wilkinson shift, then a QL sweep chasing the bulge from k up to l.
+            auto g = (d[l + 1] - d[l]) / (2 * e[l]);
+            auto r = std::hypot(g, 1.0);
+            g = d[k] - d[l] + e[l] / (g + std::copysign(r, g));
+            double s = 1, c = 1, p = 0;
+            int i;
+            for (i = k - 1; i >= l; i--) {
+                const auto f = s * e[i];
+                const auto b = c * e[i];
+                e[i + 1] = r = std::hypot(f, g);
+                if (r == 0) {
+                    d[i + 1] -= p;
+                    e[k] = 0;
+                    break;
+                }
+                s = f / r;
+                c = g / r;
+                g = d[i + 1] - p;
+                r = (d[i] - g) * s + 2 * c * b;
+                p = s * r;
+                d[i + 1] = g + p;
+                g = c * r - b;
+
+                for (int row = 0; row < m; row++) {
+                    auto &zi = z[size_t(row) * m + i];
+                    auto &zj = z[size_t(row) * m + i + 1];
+                    const auto t = zj;
+                    zj = s * zi + c * t;
+                    zi = c * zi - s * t;
+                }
+            }
+            if (r == 0 && i >= l) continue;
+            d[l] -= p;
+            e[l] = g;
+            e[k] = 0;
+        } while (true);
+    }
+
+    return true;
+}
+
+template<typename T>
+struct basic_eigenbasis_view {
+    // Ascending.
+    std::span<const T> values;
+    // Vertex major: phi_i(v) is vectors[v * count() + i], so evaluating a vertex reads one contiguous row.
+    std::span<const T> vectors;
+
+    size_t count() const { return values.size(); }
+
+    size_t size() const { return count() == 0 ? 0 : vectors.size() / count(); }
+};
+
+template<typename T>
+struct basic_eigenbasis {
+    std::vector<T> values;
+    std::vector<T> vectors;
+
+    basic_eigenbasis_view<T> view() const { return {values, vectors}; }
+};
+
+typedef basic_eigenbasis_view<F> eigenbasis_view;
+typedef basic_eigenbasis<F> eigenbasis;
+
+struct eigen_options {
+    // Ritz pairs count as converged once their residual estimate drops below tolerance times the Ritz value.
+    double tolerance = 1e-8;
+    // K is singular (constants), so the factored matrix is K + shift M with shift relative to the mean of
+    // diag(K) / M.
+    double shift = 1e-8;
+};
+
+// Shift-invert Lanczos: the largest eigenvalues theta of (K + sigma M)^-1 M are 1 / (lambda + sigma) for the smallest
+// lambda, and converge in a few times count iterations. The operator is applied with one LDL^T solve. The Lanczos
+// vectors are kept in double and fully reorthogonalized in the M inner product, twice per iteration, which costs
+// O(m^2 n) for m iterations and stores m vectors of n doubles. Returns an empty basis if K + sigma M cannot be
+// factored.
+template<typename T, typename U>
+basic_eigenbasis<T> compute_eigenbasis(const basic_laplacian<U> &op, uint32_t count, thread_pool &pool,
+                                       const eigen_options &options = {}) {
+    const auto n = op.size();
+    count = uint32_t(std::min<size_t>(count, n));
+
+    std::vector<double> mass(n);
+    double stiffness = 0, total_mass = 0;
+    for (size_t vi = 0; vi < n; vi++) {
+        mass[vi] = 1 / double(op.invMass[vi]);
+        total_mass += mass[vi];
+        for (auto k = op.offsets[vi]; k < op.offsets[vi + 1]; k++) stiffness += double(op.weights[k]);
+    }
+    const auto sigma = options.shift * stiffness / total_mass;
+
+    const auto system = build_system_matrix(op, sigma, 1.0, pool);
+    basic_ldlt<double> factorization;
+    if (!factorization.factor(system.view())) return {};
+
+    auto m_dot = [&](const double *a, const double *b) {
+        return pool.parallel_sum<double>(n, [&](size_t start, size_t end) {
+            double sum = 0;
+            for (auto i = start; i < end; i++) sum += a[i] * mass[i] * b[i];
+            return sum;
+        });
+    };
+
+    std::vector<std::vector<double>> q;
+    std::vector<double> alpha, beta;
+    std::vector<double> w(n);
+
+    // Deterministic pseudo random start vector.
+    for (size_t i = 0; i < n; i++) w[i] = double((i * 2654435761u) % 1000) / 500 - 1;
+    auto norm = std::sqrt(m_dot(w.data(), w.data()));
+
+    const auto first_check = std::min<size_t>(n, 2 * size_t(count) + 10);
+    const auto check_every = std::max<size_t>(10, count / 4);
+    std::vector<double> theta, z;
+
+    while (true) {
+        q.emplace_back(n);
+        const auto j = q.size() - 1;
+        const auto qj = q.back().data();
+        pool.parallel_for(n, [&](size_t start, size_t end) {
+            for (auto i = start; i < end; i++) qj[i] = w[i] / norm;
+        });
+
+        // w = (K + sigma M)^-1 M q_j.
+        pool.parallel_for(n, [&](size_t start, size_t end) {
+            for (auto i = start; i < end; i++) w[i] = mass[i] * qj[i];
+        });
+        factorization.solve(w.data(), w.data(), pool);
+
+        // Classical Gram-Schmidt against every Lanczos vector, twice. The coefficient of q_j is the diagonal entry.
+        double a = 0;
+        for (int pass = 0; pass < 2; pass++) {
+            const auto c = pool.parallel_reduce(n, std::vector<double>(j + 1, 0.0), [&](size_t start, size_t end) {
+                std::vector<double> partial(j + 1, 0.0);
+                for (size_t l = 0; l <= j; l++) {
+                    const auto ql = q[l].data();
+                    double sum = 0;
+                    for (auto i = start; i < end; i++) sum += ql[i] * mass[i] * w[i];
+                    partial[l] = sum;
+                }
+                return partial;
+            }, [](std::vector<double> a, const std::vector<double> &b) {
+                for (size_t l = 0; l < a.size(); l++) a[l] += b[l];
+                return a;
+            });
+
+            pool.parallel_for(n, [&](size_t start, size_t end) {
+                for (size_t l = 0; l <= j; l++) {
+                    const auto ql = q[l].data();
+                    for (auto i = start; i < end; i++) w[i] -= c[l] * ql[i];
+                }
+            });
+            a += c[j];
+        }
+        alpha.push_back(a);
+        norm = std::sqrt(m_dot(w.data(), w.data()));
+
+        const auto m = j + 1;
+        const auto exhausted = m == n || norm <= 1e-12 * std::abs(a);
+        if (m < first_check && !exhausted) {
+            beta.push_back(norm);
+            continue;
+        }
+        if (!exhausted && (m - first_check) % check_every != 0) {
+            beta.push_back(norm);
+            continue;
+        }
+
+        theta = alpha;
+        auto e = beta;
+        if (!tridiagonal_eigen(theta, e, z)) {
+            beta.push_back(norm);
+            continue;
+        }
+
+        // Ritz pairs by decreasing theta. The residual of pair i is norm times the last entry of its eigenvector.
+        std::vector<uint32_t> order(m);
+        std::iota(order.begin(), order.end(), 0);
+        std::sort(order.begin(), order.end(), [&](uint32_t x, uint32_t y) { return theta[x] > theta[y]; });
+
+        auto converged = true;
+        for (uint32_t i = 0; i < std::min<size_t>(count, m) && converged; i++) {
+            const auto r = norm * std::abs(z[(m - 1) * m + order[i]]);
+            converged = r <= options.tolerance * std::abs(theta[order[i]]);
+        }
+
+        if (converged || exhausted) {
+            count = uint32_t(std::min<size_t>(count, m));
+
+            basic_eigenbasis<T> basis;
+            basis.values.resize(count);
+            basis.vectors.resize(n * count);
+            for (uint32_t i = 0; i < count; i++) {
+                basis.values[i] = T(std::max(0.0, 1 / theta[order[i]] - sigma));
+            }
+
+            // phi_i = Q s_i.
+            pool.parallel_for(n, [&](size_t start, size_t end) {
+                std::vector<double> row(count);
+                for (auto v = start; v < end; v++) {
+                    std::fill(row.begin(), row.end(), 0.0);
+                    for (size_t l = 0; l < m; l++) {
+                        const auto qv = q[l][v];
+                        const auto zl = z.data() + l * m;
+                        for (uint32_t i = 0; i < count; i++) row[i] += qv * zl[order[i]];
+                    }
+                    for (uint32_t i = 0; i < count; i++) basis.vectors[v * count + i] = T(row[i]);
+                }
+            });
+
+            return basis;
+        }
+
+        beta.push_back(norm);
+    }
+}
+
+// Heat evolution of one initial state in an eigenbasis, which has to outlive it.
+template<typename T>
+struct basic_spectral_heat {
+    basic_eigenbasis_view<T> basis;
+    // <phi_i, u(0)>_M.
+    std::vector<double> coefficients;
+    // e^(-lambda_i t) times the coefficients, for the t being evaluated.
+    std::vector<T> weights;
+};
+
+typedef basic_spectral_heat<F> spectral_heat;
+
+template<typename T, typename U, typename S>
+basic_spectral_heat<T> project_heat(const basic_eigenbasis_view<T> &basis, const basic_laplacian<U> &op, const S *u0,
+                                    thread_pool &pool) {
+    const auto k = basis.count();
+
+    auto coefficients = pool.parallel_reduce(basis.size(), std::vector<double>(k, 0.0), [&](size_t start, size_t end) {
+        std::vector<double> partial(k, 0.0);
+        for (auto v = start; v < end; v++) {
+            const auto mu = double(u0[v]) / double(op.invMass[v]);
+            const auto phi = basis.vectors.data() + v * k;
+            for (size_t i = 0; i < k; i++) partial[i] += mu * double(phi[i]);
+        }
+        return partial;
+    }, [](std::vector<double> a, const std::vector<double> &b) {
+        for (size_t i = 0; i < a.size(); i++) a[i] += b[i];
+        return a;
+    });
+
+    return {basis, std::move(coefficients), std::vector<T>(k)};
+}
+
+// u = u(t), for any t >= 0.
+template<typename T, typename Y>
+void evaluate_heat(basic_spectral_heat<T> &heat, double t, Y *u, thread_pool &pool) {
+    const auto k = heat.basis.count();
+    for (size_t i = 0; i < k; i++) {
+        heat.weights[i] = T(std::exp(-double(heat.basis.values[i]) * t) * heat.coefficients[i]);
+    }
+
+    pool.parallel_for(heat.basis.size(), [&](size_t start, size_t end) {
+        for (auto v = start; v < end; v++) {
+            const auto phi = heat.basis.vectors.data() + v * k;
+            T sum = 0;
+            for (size_t i = 0; i < k; i++) sum += heat.weights[i] * phi[i];
+            u[v] = Y(sum);
+        }
+    });
+}
+
+// Eigenbasis cache next to the mesh cache, valid for the same source and settings and for one requested count, which
+// Lanczos may have fallen short of. Same layout rules: a header, then 64 byte aligned arrays used straight from the
+// mapping.
+
+constexpr char eigen_cache_magic[8] = {'S', 'T', 'E', 'I', 'G', 'E', 'N', 0};
+constexpr uint32_t eigen_cache_version = 2;
+
+struct eigen_cache_header {
+    char magic[8];
+    uint32_t version;
+    uint32_t scalarSize;
+    uint64_t sourceHash;
+    uint64_t settings;
+    uint64_t requestedCount;
+    // Pairs stored, at most requestedCount.
+    uint64_t count;
+    uint64_t vertexCount;
+    uint64_t valuesOffset;
+    uint64_t vectorsOffset;
+};
+
+class eigen_cache {
+public:
+    eigen_cache(const std::string &filename, uint64_t source_hash, uint64_t settings, size_t requested_count, size_t n)
+            : file(filename) {
+        if (file.size() < sizeof(eigen_cache_header)) return;
+
+        auto h = reinterpret_cast<const eigen_cache_header *>(file.data());
+        if (std::memcmp(h->magic, eigen_cache_magic, sizeof(eigen_cache_magic)) != 0) return;
+        if (h->version != eigen_cache_version || h->scalarSize != sizeof(F)) return;
+        if (h->sourceHash != source_hash || h->settings != settings) return;
+        if (h->requestedCount != requested_count || h->count > requested_count || h->vertexCount != n) return;
+
+        const auto values_size = h->count * sizeof(F), vectors_size = h->count * n * sizeof(F);
+        if (h->valuesOffset % mesh_cache_alignment != 0 || h->vectorsOffset % mesh_cache_alignment != 0) return;
+        if (h->valuesOffset > file.size() || values_size > file.size() - h->valuesOffset) return;
+        if (h->vectorsOffset > file.size() || vectors_size > file.size() - h->vectorsOffset) return;
+
+        header = h;
+    }
+
+    bool valid() const { return header != nullptr; }
+
+    eigenbasis_view view() const {
+        const auto base = file.data();
+        return {
+                {reinterpret_cast<const F *>(base + header->valuesOffset), header->count},
+                {reinterpret_cast<const F *>(base + header->vectorsOffset), header->count * header->vertexCount},
+        };
+    }
+
+private:
+    mapped_file file;
+    const eigen_cache_header *header = nullptr;
+};
+
+// Writes through a temporary file that is renamed into place, like write_mesh_cache. basis is what
+// compute_eigenbasis returned for requested_count pairs.
+bool write_eigen_cache(const std::string &filename, uint64_t source_hash, uint64_t settings, size_t requested_count,
+                       const eigenbasis_view &basis) {
+    const auto temp_filename = filename + ".tmp";
+
+    {
+        std::ofstream out(temp_filename, std::ios::binary | std::ios::trunc);
+        if (!out) return false;
+
+        auto align = [](uint64_t offset) {
+            return (offset + mesh_cache_alignment - 1) / mesh_cache_alignment * mesh_cache_alignment;
+        };
+
+        eigen_cache_header h{};
+        std::memcpy(h.magic, eigen_cache_magic, sizeof(eigen_cache_magic));
+        h.version = eigen_cache_version;
+        h.scalarSize = sizeof(F);
+        h.sourceHash = source_hash;
+        h.settings = settings;
+        h.requestedCount = requested_count;
+        h.count = basis.count();
+        h.vertexCount = basis.size();
+        h.valuesOffset = align(sizeof(h));
+        h.vectorsOffset = align(h.valuesOffset + basis.values.size_bytes());
+
+        const char padding[mesh_cache_alignment] = {};
+        out.write(reinterpret_cast<const char *>(&h), sizeof(h));
+        out.write(padding, h.valuesOffset - sizeof(h));
+        out.write(as_chars(basis.values).data(), basis.values.size_bytes());
+        out.write(padding, h.vectorsOffset - h.valuesOffset - basis.values.size_bytes());
+        out.write(as_chars(basis.vectors).data(), basis.vectors.size_bytes());
+
+        if (!out) return false;
+    }
+
+    std::error_code error;
+    std::filesystem::rename(temp_filename, filename, error);
+    return !error;
+}
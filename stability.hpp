@@ -0,0 +1,91 @@
+#pragma once
+
+#include <span>
+#include <vector>
+#include <algorithm>
+#include <cmath>
+#include <cstdint>
+
+#include "model.hpp"
+#include "sparse.hpp"
+#include "laplacian.hpp"
+#include "thread_pool.hpp"
+
+// Explicit Euler on u' = A u with A = M^-1 L is stable for dt < 2 / rho(A). A is similar to the symmetric negative
+// semidefinite M^-1/2 L M^-1/2, so its eigenvalues are real and rho(A) is the magnitude of the most negative one.
+
+struct time_step_estimate {
+    // Upper bound of rho(A) from the Gershgorin discs.
+    double gershgorin = 0;
+    // Power iteration estimate of rho(A), which approaches it from below.
+    double power = 0;
+
+    // Provably stable.
+    double safe_dt() const { return 2 / gershgorin; }
+
+    // Close to the real limit. The power estimate is a lower bound of rho(A), so the safety factor covers the part of
+    // the spectrum it has not converged to yet.
+    double estimated_dt(double safety = 0.9) const { return safety * 2 / power; }
+
+    double dt() const { return std::max(safe_dt(), estimated_dt()); }
+
+    // Leapfrog on the wave equation u'' = A u is stable for dt^2 rho(A) < 4, chosen the same way as dt().
+    double wave_dt(double safety = 0.9) const {
+        return std::max(2 / std::sqrt(gershgorin), safety * 2 / std::sqrt(power));
+    }
+};
+
+// Power iteration on A with the Rayleigh quotient taken in the M inner product, where A is self adjoint. Vectors are
+// kept in double whatever T is.
+template<typename T>
+time_step_estimate estimate_time_step(const basic_laplacian<T> &op, thread_pool &pool, uint32_t iterations = 30) {
+    const auto A = op.matrix();
+    const auto n = A.size();
+    time_step_estimate estimate;
+
+    estimate.gershgorin = pool.parallel_reduce(n, 0.0, [&](size_t start, size_t end) {
+        double bound = 0;
+        for (auto i = start; i < end; i++) {
+            double sum = std::abs(double(A.diagonal[i]));
+            for (auto k = A.offsets[i]; k < A.offsets[i + 1]; k++) {
+                sum += std::abs(double(A.values[k]));
+            }
+            bound = std::max(bound, sum);
+        }
+        return bound;
+    }, [](double a, double b) { return std::max(a, b); });
+
+    // Deterministic pseudo random start, so every eigenvector has a share of it.
+    std::vector<double> x(n), y(n);
+    for (size_t i = 0; i < n; i++) {
+        x[i] = double((i * 2654435761u) % 1000) / 500 - 1;
+    }
+
+    auto m_dot = [&](const std::vector<double> &a, const std::vector<double> &b) {
+        return pool.parallel_sum<double>(n, [&](size_t start, size_t end) {
+            double sum = 0;
+            for (auto i = start; i < end; i++) sum += a[i] * b[i] / double(op.invMass[i]);
+            return sum;
+        });
+    };
+
+    for (uint32_t it = 0; it < iterations; it++) {
+        pool.parallel_for(n, [&](size_t start, size_t end) {
+            for (auto i = start; i < end; i++) y[i] = A.template row_dot<double>(x.data(), i);
+        });
+
+        const auto xx = m_dot(x, x);
+        const auto xy = m_dot(x, y);
+        if (xx == 0) break;
+        estimate.power = std::abs(xy / xx);
+
+        const auto scale = 1 / std::sqrt(m_dot(y, y));
+        if (!std::isfinite(scale)) break;
+        pool.parallel_for(n, [&](size_t start, size_t end) {
+            for (auto i = start; i < end; i++) x[i] = y[i] * scale;
+        });
+    }
+
+    estimate.power = std::min(std::max(estimate.power, 1e-30), estimate.gershgorin);
+    return estimate;
+}
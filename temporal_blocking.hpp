@@ -0,0 +1,144 @@
+#pragma once
+
+#include <vector>
+#include <algorithm>
+#include <cstdint>
+
+#include "model.hpp"
+#include "sparse.hpp"
+#include "thread_pool.hpp"
+
+// Temporally blocked explicit stepping. The mesh is cut into patches small enough to stay in cache, and every patch
+// carries a ghost layer of depth k around it. A block advances each patch k steps in local buffers, updating one
+// ghost layer less every step, after which the patch's own vertices hold exactly the values k global steps would
+// produce. The state then goes through DRAM once per k steps instead of once per step, at the price of recomputing
+// the ghost layers.
+
+template<typename T>
+struct basic_temporal_patch {
+    // Global vertex of every local vertex, ordered by distance from the patch: the patch itself, then the ghost
+    // layers one after another.
+    std::vector<uint32_t> globals;
+    // layerEnds[d] is the number of local vertices at distance <= d, layerEnds[0] being the patch size.
+    std::vector<uint32_t> layerEnds;
+    // Step operator rows of the vertices at distance < k, with local column indices.
+    std::vector<uint32_t> offsets;
+    std::vector<uint32_t> columns;
+    std::vector<T> values;
+    std::vector<T> diagonal;
+};
+
+template<typename T>
+struct basic_temporal_blocking {
+    uint32_t depth = 0;
+    std::vector<basic_temporal_patch<T>> patches;
+};
+
+typedef basic_temporal_blocking<F> temporal_blocking;
+
+// Grows patches of up to patch_size vertices breadth-first and extracts their depth-k neighborhoods from A.
+template<typename T>
+basic_temporal_blocking<T> build_temporal_blocking(const basic_csr_view<T> &A, uint32_t depth,
+                                                   uint32_t patch_size = 4096) {
+    const auto n = A.size();
+
+    basic_temporal_blocking<T> blocking;
+    blocking.depth = std::max(1u, depth);
+    depth = blocking.depth;
+
+    std::vector<uint32_t> patch_of(n, invalid_index);
+    std::vector<uint32_t> local(n, invalid_index);
+
+    for (uint32_t seed = 0; seed < n; seed++) {
+        if (patch_of[seed] != invalid_index) continue;
+
+        const auto p = uint32_t(blocking.patches.size());
+        auto &patch = blocking.patches.emplace_back();
+        auto &globals = patch.globals;
+
+        globals.push_back(seed);
+        patch_of[seed] = p;
+        for (size_t head = 0; head < globals.size() && globals.size() < patch_size; head++) {
+            const auto vi = globals[head];
+            for (auto k = A.offsets[vi]; k < A.offsets[vi + 1] && globals.size() < patch_size; k++) {
+                const auto ni = A.columns[k];
+                if (patch_of[ni] != invalid_index) continue;
+                patch_of[ni] = p;
+                globals.push_back(ni);
+            }
+        }
+
+        for (uint32_t i = 0; i < globals.size(); i++) {
+            local[globals[i]] = i;
+        }
+        patch.layerEnds.push_back(globals.size());
+
+        // Every ghost layer is the set of unseen neighbors of the previous one.
+        for (uint32_t d = 1; d <= depth; d++) {
+            const auto begin = d == 1 ? 0 : patch.layerEnds[d - 2];
+            const auto end = patch.layerEnds[d - 1];
+            for (auto i = begin; i < end; i++) {
+                const auto vi = globals[i];
+                for (auto k = A.offsets[vi]; k < A.offsets[vi + 1]; k++) {
+                    const auto ni = A.columns[k];
+                    if (local[ni] != invalid_index) continue;
+                    local[ni] = globals.size();
+                    globals.push_back(ni);
+                }
+            }
+            patch.layerEnds.push_back(globals.size());
+        }
+
+        const auto rows = patch.layerEnds[depth - 1];
+        patch.offsets.push_back(0);
+        for (uint32_t i = 0; i < rows; i++) {
+            const auto vi = globals[i];
+            for (auto k = A.offsets[vi]; k < A.offsets[vi + 1]; k++) {
+                patch.columns.push_back(local[A.columns[k]]);
+                patch.values.push_back(A.values[k]);
+            }
+            patch.offsets.push_back(patch.columns.size());
+            patch.diagonal.push_back(A.diagonal[vi]);
+        }
+
+        for (const auto &vi : globals) {
+            local[vi] = invalid_index;
+        }
+    }
+
+    return blocking;
+}
+
+// Advances old_us by depth explicit steps of dt into us for the patches [first, last). The patch buffers are kept in
+// the accumulation type, so only the global state is rounded to S, once per block.
+template<typename T, typename S, typename A>
+void temporal_blocking_worker(const basic_temporal_blocking<T> &blocking, const std::vector<S> &old_us,
+                              std::vector<S> &us, const A &dt, size_t first, size_t last) {
+    thread_local std::vector<A> a, b;
+
+    for (auto p = first; p < last; p++) {
+        const auto &patch = blocking.patches[p];
+
+        a.resize(patch.globals.size());
+        b.resize(patch.globals.size());
+        for (size_t i = 0; i < patch.globals.size(); i++) {
+            a[i] = A(old_us[patch.globals[i]]);
+        }
+
+        for (uint32_t s = 1; s <= blocking.depth; s++) {
+            const auto rows = patch.layerEnds[blocking.depth - s];
+            for (uint32_t i = 0; i < rows; i++) {
+                A sum = A(patch.diagonal[i]) * a[i];
+                for (auto k = patch.offsets[i]; k < patch.offsets[i + 1]; k++) {
+                    sum += A(patch.values[k]) * a[patch.columns[k]];
+                }
+                b[i] = a[i] + sum * dt;
+            }
+            std::swap(a, b);
+        }
+
+        for (uint32_t i = 0; i < patch.layerEnds[0]; i++) {
+            us[patch.globals[i]] = S(a[i]);
+        }
+    }
+}
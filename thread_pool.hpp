@@ -0,0 +1,126 @@
+#pragma once
+
+#include <vector>
+#include <thread>
+#include <atomic>
+#include <algorithm>
+#include <cstdint>
+#include <utility>
+
+// Fixed set of worker threads that stay alive between dispatches. A dispatch publishes the task by bumping a
+// generation counter and waits on a pending counter, so it costs two atomic notifications instead of thread
+// creation. The calling thread takes part as worker 0.
+class thread_pool {
+public:
+    // n is the total number of workers including the caller, 0 picks hardware_concurrency.
+    explicit thread_pool(uint32_t n = 0) {
+        if (n == 0) n = std::max(1u, std::thread::hardware_concurrency());
+
+        for (uint32_t i = 1; i < n; i++) {
+            threads.emplace_back(&thread_pool::worker, this, i);
+        }
+    }
+
+    ~thread_pool() {
+        stopping = true;
+        generation.fetch_add(1, std::memory_order_release);
+        generation.notify_all();
+
+        for (auto &t : threads) {
+            t.join();
+        }
+    }
+
+    thread_pool(const thread_pool &) = delete;
+    thread_pool &operator=(const thread_pool &) = delete;
+
+    uint32_t size() const { return threads.size() + 1; }
+
+    // Runs task(i) for every worker index i in [0, size()) and returns once all of them have finished.
+    template<typename Task>
+    void run(const Task &task) {
+        context = &task;
+        invoke = [](const void *context, uint32_t i) { (*static_cast<const Task *>(context))(i); };
+
+        pending.store(threads.size(), std::memory_order_relaxed);
+        generation.fetch_add(1, std::memory_order_release);
+        generation.notify_all();
+
+        task(0);
+
+        for (auto p = pending.load(std::memory_order_acquire); p != 0; p = pending.load(std::memory_order_acquire)) {
+            pending.wait(p, std::memory_order_acquire);
+        }
+    }
+
+    // Splits [0, count) into size() contiguous batches and runs body(start, end) on each of them.
+    template<typename Body>
+    void parallel_for(size_t count, const Body &body) {
+        run([&](uint32_t i) {
+            const auto [start, end] = batch(count, i);
+            body(start, end);
+        });
+    }
+
+    // Like parallel_for, but body returns a partial result and the partials are folded with combine, starting from
+    // identity. They are folded in batch order, so the result only depends on the number of workers, not on timing.
+    template<typename T, typename Body, typename Combine>
+    T parallel_reduce(size_t count, T identity, const Body &body, const Combine &combine) {
+        std::vector<T> partials(size(), identity);
+        run([&](uint32_t i) {
+            const auto [start, end] = batch(count, i);
+            partials[i] = body(start, end);
+        });
+
+        for (const auto &p : partials) {
+            identity = combine(identity, p);
+        }
+        return identity;
+    }
+
+    template<typename T, typename Body>
+    T parallel_sum(size_t count, const Body &body) {
+        return parallel_reduce(count, T(0), body, [](const T &a, const T &b) { return a + b; });
+    }
+
+private:
+    std::vector<std::thread> threads;
+
+    const void *context = nullptr;
+    void (*invoke)(const void *, uint32_t) = nullptr;
+
+    std::atomic<uint32_t> generation{0};
+    std::atomic<uint32_t> pending{0};
+    std::atomic<bool> stopping{false};
+
+    std::pair<size_t, size_t> batch(size_t count, uint32_t i) const {
+        const auto n = size();
+        const auto batch_size = count / n;
+
+        auto start = i * batch_size;
+        auto end = (i + 1) * batch_size;
+
+        if (i == n - 1) {
+            end += count % n;
+        }
+
+        return {start, end};
+    }
+
+    void worker(uint32_t i) {
+        uint32_t seen = 0;
+
+        while (true) {
+            generation.wait(seen, std::memory_order_acquire);
+            seen = generation.load(std::memory_order_acquire);
+
+            if (stopping) return;
+
+            invoke(context, i);
+
+            if (pending.fetch_sub(1, std::memory_order_acq_rel) == 1) {
+                pending.notify_one();
+            }
+        }
+    }
+};
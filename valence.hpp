@@ -0,0 +1,144 @@
+#pragma once
+
+#include <vector>
+#include <algorithm>
+#include <utility>
+#include <cstdint>
+
+#include "model.hpp"
+#include "sparse.hpp"
+#include "thread_pool.hpp"
+
+// Copy of a csr_view with the rows grouped by valence. Rows of valence valence_min..valence_max are stored with a
+// fixed stride of N entries and run through a kernel instantiated for that N, so the neighbor loop has a compile time
+// trip count and is fully unrolled. Regular meshes are almost entirely valence 6, the few irregular vertices of other
+// valences go through a generic CSR loop.
+
+constexpr uint32_t valence_min = 3;
+constexpr uint32_t valence_max = 8;
+// One class per specialized valence plus the generic class.
+constexpr uint32_t valence_classes = valence_max - valence_min + 2;
+constexpr uint32_t valence_generic = valence_classes - 1;
+
+template<typename T>
+struct basic_valence_matrix {
+    // Rows sorted by class, ascending within a class.
+    std::vector<uint32_t> rows;
+    // Start of every class in rows, plus the end.
+    std::vector<uint32_t> classOffsets;
+    // Start of every class in columns and values, plus the end.
+    std::vector<uint32_t> entryOffsets;
+    // Start of every generic row in columns and values, plus the end.
+    std::vector<uint32_t> genericOffsets;
+    std::vector<uint32_t> columns;
+    std::vector<T> values;
+    // Diagonal in rows order.
+    std::vector<T> diagonal;
+
+    size_t size() const { return rows.size(); }
+};
+
+typedef basic_valence_matrix<F> valence_matrix;
+
+template<typename T>
+basic_valence_matrix<T> build_valence_matrix(const basic_csr_view<T> &A) {
+    const auto n = A.size();
+
+    auto valence_class = [&](uint32_t row) {
+        const auto valence = A.offsets[row + 1] - A.offsets[row];
+        return valence >= valence_min && valence <= valence_max ? valence - valence_min : valence_generic;
+    };
+
+    basic_valence_matrix<T> M;
+    M.classOffsets.assign(valence_classes + 1, 0);
+    M.entryOffsets.assign(valence_classes + 1, 0);
+    for (uint32_t row = 0; row < n; row++) {
+        const auto c = valence_class(row);
+        M.classOffsets[c + 1]++;
+        M.entryOffsets[c + 1] += A.offsets[row + 1] - A.offsets[row];
+    }
+    for (uint32_t c = 0; c < valence_classes; c++) {
+        M.classOffsets[c + 1] += M.classOffsets[c];
+        M.entryOffsets[c + 1] += M.entryOffsets[c];
+    }
+
+    M.rows.resize(n);
+    M.diagonal.resize(n);
+    M.columns.resize(A.columns.size());
+    M.values.resize(A.columns.size());
+    M.genericOffsets.push_back(M.entryOffsets[valence_generic]);
+
+    auto positions = M.classOffsets;
+    auto entries = M.entryOffsets;
+    for (uint32_t row = 0; row < n; row++) {
+        const auto c = valence_class(row);
+        const auto p = positions[c]++;
+        M.rows[p] = row;
+        M.diagonal[p] = A.diagonal[row];
+
+        for (auto k = A.offsets[row]; k < A.offsets[row + 1]; k++) {
+            M.columns[entries[c]] = A.columns[k];
+            M.values[entries[c]] = A.values[k];
+            entries[c]++;
+        }
+        if (c == valence_generic) M.genericOffsets.push_back(entries[c]);
+    }
+
+    return M;
+}
+
+// y = beta * x + alpha * A x for the valence N rows among the sorted positions [first, last).
+template<uint32_t N, typename T, typename X, typename Y, typename A>
+void valence_kernel_fixed(const basic_valence_matrix<T> &M, const X *x, Y *y, A alpha, A beta, size_t first,
+                          size_t last) {
+    const auto c = N - valence_min;
+    const size_t begin = M.classOffsets[c];
+    first = std::max(first, begin);
+    last = std::min<size_t>(last, M.classOffsets[c + 1]);
+
+    const auto columns = M.columns.data() + M.entryOffsets[c];
+    const auto values = M.values.data() + M.entryOffsets[c];
+
+    for (auto p = first; p < last; p++) {
+        const auto row = M.rows[p];
+        const auto k = (p - begin) * N;
+
+        A sum = A(M.diagonal[p]) * A(x[row]);
+#pragma GCC unroll 16
+        for (uint32_t j = 0; j < N; j++) {
+            sum += A(values[k + j]) * A(x[columns[k + j]]);
+        }
+
+        y[row] = Y(beta * A(x[row]) + alpha * sum);
+    }
+}
+
+template<typename T, typename X, typename Y, typename A>
+void valence_kernel_generic(const basic_valence_matrix<T> &M, const X *x, Y *y, A alpha, A beta, size_t first,
+                            size_t last) {
+    const size_t begin = M.classOffsets[valence_generic];
+    first = std::max(first, begin);
+    last = std::min<size_t>(last, M.classOffsets[valence_generic + 1]);
+
+    for (auto p = first; p < last; p++) {
+        const auto row = M.rows[p];
+        const auto i = p - begin;
+
+        A sum = A(M.diagonal[p]) * A(x[row]);
+        for (auto k = M.genericOffsets[i]; k < M.genericOffsets[i + 1]; k++) {
+            sum += A(M.values[k]) * A(x[M.columns[k]]);
+        }
+
+        y[row] = Y(beta * A(x[row]) + alpha * sum);
+    }
+}
+
+// y = beta * x + alpha * A x over the sorted positions [first, last). x and y must not alias.
+template<typename T, typename X, typename Y, typename A>
+void valence_kernel(const basic_valence_matrix<T> &M, const X *x, Y *y, A alpha, A beta, size_t first, size_t last) {
+    [&]<uint32_t... I>(std::integer_sequence<uint32_t, I...>) {
+        (valence_kernel_fixed<valence_min + I>(M, x, y, alpha, beta, first, last), ...);
+    }(std::make_integer_sequence<uint32_t, valence_max - valence_min + 1>());
+
+    valence_kernel_generic(M, x, y, alpha, beta, first, last);
+}